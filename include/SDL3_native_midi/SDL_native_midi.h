@@ -44,13 +44,165 @@ extern "C" {
 
 typedef struct NativeMidi_Song NativeMidi_Song;
 
+/* On ALSA, all songs share one sequencer client, each song playing on a queue
+   of its own. NativeMidi_Init opens that client, and it stays open until
+   NativeMidi_Quit or until the last song is destroyed, whichever is later.
+   Without NativeMidi_Init, the first song loaded opens it. */
 extern SDL_DECLSPEC bool SDLCALL NativeMidi_Init(void);
 extern SDL_DECLSPEC void SDLCALL NativeMidi_Quit(void);
+/* Memory streams (SDL_IOFromMem, SDL_IOFromConstMem) are decoded in place.
+   If that memory stays valid until the song is destroyed, set the hint
+   "SDL_NATIVE_MIDI_ZERO_COPY" to "1" and SysEx/meta data will point into it
+   instead of being copied. NativeMidi_LoadSong maps the file where the
+   platform allows, and does this on its own.
+   Set "SDL_NATIVE_MIDI_PARALLEL_DECODE" to "1" to decode the tracks of large
+   multi-track files on several threads. Files whose tracks add up to less
+   than "SDL_NATIVE_MIDI_PARALLEL_DECODE_THRESHOLD" bytes (256 KiB by default)
+   are still decoded on the calling thread.
+   On ALSA, setting "SDL_NATIVE_MIDI_STREAMING" to "1" skips decoding at load
+   time altogether; the song is decoded bit by bit while it plays. Setting
+   "SDL_NATIVE_MIDI_COMPACT" to "1" instead decodes songs as usual but keeps
+   them packed, at a quarter of the memory or less, and they're unpacked bit
+   by bit while they play. That's meant for keeping lots of songs loaded.
+   Set "SDL_NATIVE_MIDI_THIN" to "1" to drop events that change nothing while
+   decoding: controller values, programs and pitch bends a channel already
+   has, and notes doubled at the same time. "SDL_NATIVE_MIDI_THIN_TOLERANCE"
+   (0 by default, up to 127) also drops changes of continuous controllers
+   and pitch bends by no more than that much (in steps of 128 for pitch
+   bends) in between closely following ones, which thins out dense sweeps.
+   Not used by the macOS backend, nor for streamed songs.
+   On ALSA, the kernel pool and output buffer of the sequencer client grow to
+   suit the densest song loaded, the next time a song is loaded or started
+   while nothing is playing. SysEx messages too long for the buffer still get
+   through, just less efficiently. Set
+   "SDL_NATIVE_MIDI_ALSA_POOL_SIZE" (in events, up to 2000) and
+   "SDL_NATIVE_MIDI_ALSA_BUFFER_SIZE" (in bytes) to size them yourself; see
+   output_stalls in NativeMidi_SongStats for whether they're big enough.
+   ALSA otherwise queues as much of a song as the sequencer takes, which can
+   be seconds ahead of what's playing. Set "SDL_NATIVE_MIDI_ALSA_LOOKAHEAD"
+   to a number of milliseconds (50 to 200 works well) to only keep that much
+   queued, so the sequencer holds far fewer events, and pausing, stopping and
+   seeking have less to throw away. Timing stays exactly the same. */
 extern SDL_DECLSPEC NativeMidi_Song * SDLCALL NativeMidi_LoadSong_IO(SDL_IOStream *src, bool closeio);
 extern SDL_DECLSPEC NativeMidi_Song * SDLCALL NativeMidi_LoadSong(const char *path);
+/* Load count songs at once, on as many threads as the machine has cores.
+   songs[i] is the song loaded from paths[i], or NULL if that one failed, in
+   which case this function returns false (with the error of the first song
+   that failed) but still loads the rest. Songs can be loaded from several
+   threads at once either way. */
+extern SDL_DECLSPEC bool SDLCALL NativeMidi_LoadSongs(const char * const *paths, int count, NativeMidi_Song **songs);
+/* Load a song in the background, so the calling thread never waits on the
+   file or the decoding. The file is read with SDL's async I/O and decoded on
+   a thread of its own. Poll NativeMidi_IsAsyncLoadDone, then collect the song
+   with NativeMidi_FinishAsyncLoad, which returns NULL (with the error set) if
+   it didn't load and frees the handle either way. Calling it early waits for
+   the song; every handle must be finished exactly once. */
+typedef struct NativeMidi_AsyncLoad NativeMidi_AsyncLoad;
+
+extern SDL_DECLSPEC NativeMidi_AsyncLoad * SDLCALL NativeMidi_LoadSongAsync(const char *path);
+extern SDL_DECLSPEC bool SDLCALL NativeMidi_IsAsyncLoadDone(NativeMidi_AsyncLoad *load);
+extern SDL_DECLSPEC NativeMidi_Song * SDLCALL NativeMidi_FinishAsyncLoad(NativeMidi_AsyncLoad *load);
 extern SDL_DECLSPEC void SDLCALL NativeMidi_DestroySong(NativeMidi_Song *song);
+
+/* Convert a MIDI file into a precompiled song, which loads like any other
+   song but skips all parsing. Mapped from a file, it is even played straight
+   from the mapping. Precompiled songs are tied to the version of this library
+   that made them, and aren't understood by the macOS backend, which hands
+   songs to the OS as they are. */
+extern SDL_DECLSPEC bool SDLCALL NativeMidi_CompileSong_IO(SDL_IOStream *src, bool closesrc, SDL_IOStream *dst, bool closedst);
+extern SDL_DECLSPEC bool SDLCALL NativeMidi_CompileSong(const char *srcpath, const char *dstpath);
+
+/* Decoded songs can be cached, so that loading the same data again (from any
+   source) skips decoding, and songs loaded from the same data share their
+   events. The cache is off by default; set the hint
+   "SDL_NATIVE_MIDI_CACHE_SIZE" to the number of bytes it may use, and the
+   least recently used songs are dropped to stay within that. Each cached
+   song keeps a copy of the data it was loaded from, which counts toward the
+   budget; a song is only handed out again if the data is the very same.
+   Dropping a song from the cache doesn't affect songs that are still loaded.
+   Not used by the macOS backend. */
+typedef struct NativeMidi_CacheStats
+{
+    Uint64 hits;        /* loads that found their song in the cache */
+    Uint64 misses;      /* loads that had to decode their song */
+    Uint64 evictions;   /* songs dropped to stay within the budget */
+    Uint64 bytes;       /* memory taken up by cached songs */
+    int songs;          /* number of cached songs */
+} NativeMidi_CacheStats;
+
+extern SDL_DECLSPEC void SDLCALL NativeMidi_GetCacheStats(NativeMidi_CacheStats *stats);
+extern SDL_DECLSPEC void SDLCALL NativeMidi_ClearCache(void);
+
+/* What a loaded song costs. Event data may be shared with other songs and
+   the cache (see above); it is counted in full for every song using it. */
+typedef struct NativeMidi_SongStats
+{
+    Uint32 events;          /* number of events, 0 while a MIDI file is streamed */
+    Uint32 thinned_events;  /* events dropped as redundant when decoding (see above) */
+    Uint64 payload_bytes;   /* SysEx and meta event data */
+    Uint64 allocations;     /* heap allocations held by the song */
+    Uint64 resident_bytes;  /* heap memory held by the song */
+    Uint64 mapped_bytes;    /* file data mapped for the song, paged in as needed */
+    bool shared;            /* event data is shared with other songs or the cache */
+    Uint32 output_stalls;   /* times playback found the sequencer full and had to wait (ALSA only) */
+} NativeMidi_SongStats;
+
+/* Not supported by the macOS backend, whose songs belong to the OS. */
+extern SDL_DECLSPEC bool SDLCALL NativeMidi_GetSongStats(NativeMidi_Song *song, NativeMidi_SongStats *stats);
+
+/* Library-wide heap use, counting everything this library allocates for
+   songs and the cache. */
+typedef struct NativeMidi_MemoryStats
+{
+    Uint64 live_allocations;    /* allocations not freed yet */
+    Uint64 live_bytes;          /* memory held by them */
+    Uint64 peak_bytes;          /* most memory held at any one time */
+    Uint64 total_allocations;   /* allocations made so far */
+} NativeMidi_MemoryStats;
+
+extern SDL_DECLSPEC void SDLCALL NativeMidi_GetMemoryStats(NativeMidi_MemoryStats *stats);
+
+/* Song length and positions. Positions within a song are given in ticks,
+   the time unit of MIDI files, and convert to microseconds following the
+   song's tempo changes, and to bars and beats following its time signatures.
+   Both are indexed when the song is loaded (for streamed songs, when first
+   asked for), so every conversion is a binary search. Songs without tempo
+   changes or time signatures play at 120 beats per minute in 4/4. */
+typedef struct NativeMidi_BarBeat
+{
+    Uint32 bar;     /* counted from 0 */
+    Uint32 beat;    /* within the bar, counted from 0 */
+    Uint32 tick;    /* within the beat */
+} NativeMidi_BarBeat;
+
+/* Return the length of a song in microseconds, or -1 on error. */
+extern SDL_DECLSPEC Sint64 SDLCALL NativeMidi_GetSongLength(NativeMidi_Song *song);
+/* Return the length of a song in ticks, or -1 on error. */
+extern SDL_DECLSPEC Sint64 SDLCALL NativeMidi_GetSongLengthTicks(NativeMidi_Song *song);
+/* Return the time at which a tick is played, or -1 on error. */
+extern SDL_DECLSPEC Sint64 SDLCALL NativeMidi_TicksToMicroseconds(NativeMidi_Song *song, Uint32 ticks);
+/* Return the tick played at a time, or -1 on error. */
+extern SDL_DECLSPEC Sint64 SDLCALL NativeMidi_MicrosecondsToTicks(NativeMidi_Song *song, Uint64 us);
+extern SDL_DECLSPEC bool SDLCALL NativeMidi_TicksToBarBeat(NativeMidi_Song *song, Uint32 ticks, NativeMidi_BarBeat *pos);
+/* Return the tick a bar and beat start at, or -1 on error. */
+extern SDL_DECLSPEC Sint64 SDLCALL NativeMidi_BarBeatToTicks(NativeMidi_Song *song, const NativeMidi_BarBeat *pos);
+
 extern SDL_DECLSPEC void SDLCALL NativeMidi_Start(NativeMidi_Song *song, int loops);
 
+/* Jump to a time within a song, in milliseconds. A playing song goes on from
+   there right away; for any other song, that's where the next
+   NativeMidi_Start begins. On ALSA, every channel is set up the way the song
+   has it at that point (controllers, program, pitch bend and tempo), so
+   instruments sound right after the jump. Decoded songs keep checkpoints of
+   that state, so a seek only replays a few thousand events at most; streamed
+   songs are replayed from the start.
+   Supported on ALSA and macOS. */
+extern SDL_DECLSPEC bool SDLCALL NativeMidi_Seek(NativeMidi_Song *song, Uint64 ms);
+
+/* These act on the song started last. On ALSA, they may be called from any
+   thread, even while another one destroys the song, and only hand the player
+   a command without waiting for it (but for Stop), so a fade that sets the
+   volume every frame costs next to nothing. */
 /* !!! FIXME: these are not hooked up on Haiku OS! */
 /* (Works on ALSA, macOS, and Windows, though!) */
 extern SDL_DECLSPEC void SDLCALL NativeMidi_Pause(void);
@@ -58,8 +210,40 @@ extern SDL_DECLSPEC void SDLCALL NativeMidi_Resume(void);
 
 extern SDL_DECLSPEC void SDLCALL NativeMidi_Stop(void);
 extern SDL_DECLSPEC bool SDLCALL NativeMidi_Active(void);
+/* Get where the current song is: the tick being played, and how far into the
+   song that is in milliseconds. Either pointer may be NULL. This doesn't wait
+   on the player, so it's fine to call every frame; on ALSA, it carries on
+   from where the player last saw the sequencer, which happens a few times a
+   second. A streamed song is scanned for its time map the first time.
+   Supported on ALSA and macOS. */
+extern SDL_DECLSPEC bool SDLCALL NativeMidi_GetPosition(Uint32 *ticks, Uint64 *ms);
 extern SDL_DECLSPEC void SDLCALL NativeMidi_SetVolume(float volume);
 
+/* Where songs are played. On ALSA, that's the sequencer ports that take MIDI;
+   by default, songs go to the first synthesizer there is (or whatever
+   ALSA_OUTPUT_PORTS says), or else to the first MIDI port. The ports are
+   looked up once, and again only when ALSA says ports came or went, so
+   listing them is cheap. That's checked while a song plays, and by
+   NativeMidi_Start and the functions below otherwise: a playing song moves
+   on to another destination within a fraction of a second if its own goes
+   away, and back to a selected one once that returns.
+   Supported on ALSA. */
+typedef struct NativeMidi_Destination
+{
+    Uint32 id;          /* identifies the destination; 0 is never used */
+    char name[128];     /* client and port name */
+    bool synth;         /* a synthesizer rather than some other MIDI port */
+    bool connected;     /* songs are being played on it */
+} NativeMidi_Destination;
+
+/* Return an array of count destinations, to be freed with SDL_free, or NULL
+   on error. */
+extern SDL_DECLSPEC NativeMidi_Destination * SDLCALL NativeMidi_GetDestinations(int *count);
+/* Play songs on a destination from now on, including songs that are playing
+   already. While it's gone, songs play wherever they would by default. Pass
+   0 to go back to picking one automatically. */
+extern SDL_DECLSPEC bool SDLCALL NativeMidi_SelectDestination(Uint32 id);
+
 /* Ends C function definitions when using C++ */
 #ifdef __cplusplus
 }
@@ -35,7 +35,7 @@
 
 #include <errno.h>
 #include <poll.h>
-#include <sys/socket.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -52,9 +52,15 @@ static int load_alsa_syms(void);
 #define snd_seq_client_info_sizeof ALSA_snd_seq_client_info_sizeof
 #define snd_seq_port_info_sizeof   ALSA_snd_seq_port_info_sizeof
 #define snd_seq_queue_tempo_sizeof ALSA_snd_seq_queue_tempo_sizeof
+#define snd_seq_queue_status_sizeof ALSA_snd_seq_queue_status_sizeof
+#define snd_seq_remove_events_sizeof ALSA_snd_seq_remove_events_sizeof
 #define snd_seq_control_queue      ALSA_snd_seq_control_queue
 
+/* Every open sequencer holds a reference to the library, and songs may be */
+/* loaded and destroyed on any thread */
 static void *alsa_handle = NULL;
+static int alsa_refcount = 0;
+static SDL_SpinLock alsa_lock;
 
 static int load_alsa_sym(const char *fn, void **addr)
 {
@@ -72,15 +78,18 @@ static int load_alsa_sym(const char *fn, void **addr)
 
 static void unload_alsa_library(void)
 {
-    if (alsa_handle) {
+    SDL_LockSpinlock(&alsa_lock);
+    if (alsa_refcount > 0 && --alsa_refcount == 0) {
         SDL_UnloadObject(alsa_handle);
         alsa_handle = NULL;
     }
+    SDL_UnlockSpinlock(&alsa_lock);
 }
 
 static int load_alsa_library(void)
 {
     int retval = 0;
+    SDL_LockSpinlock(&alsa_lock);
     if (!alsa_handle) {
         alsa_handle = SDL_LoadObject(SDL_NATIVE_MIDI_ALSA_DYNAMIC);
         if (!alsa_handle) {
@@ -89,10 +98,15 @@ static int load_alsa_library(void)
         } else {
             retval = load_alsa_syms();
             if (retval < 0) {
-                unload_alsa_library();
+                SDL_UnloadObject(alsa_handle);
+                alsa_handle = NULL;
             }
         }
     }
+    if (retval == 0) {
+        alsa_refcount++;
+    }
+    SDL_UnlockSpinlock(&alsa_lock);
     return retval;
 }
 
@@ -112,35 +126,47 @@ static int load_alsa_library(void)
 static int (*ALSA_snd_seq_alloc_named_queue)(snd_seq_t *seq, const char *name);
 static int (*ALSA_snd_seq_client_id)(snd_seq_t *handle);
 static int (*ALSA_snd_seq_client_info_get_client)(const snd_seq_client_info_t *info);
+static const char *(*ALSA_snd_seq_client_info_get_name)(snd_seq_client_info_t *info);
 static size_t (*ALSA_snd_seq_client_info_sizeof)(void);
 static int (*ALSA_snd_seq_close)(snd_seq_t *handle);
+static int (*ALSA_snd_seq_connect_from)(snd_seq_t *seq, int my_port, int src_client, int src_port);
 static int (*ALSA_snd_seq_connect_to)(snd_seq_t *seq, int my_port, int dest_client, int dest_port);
 static int (*ALSA_snd_seq_control_queue)(snd_seq_t *seq, int q, int type, int value, snd_seq_event_t *ev);
 static int (*ALSA_snd_seq_create_simple_port)(snd_seq_t *seq, const char *name, unsigned int caps, unsigned int type);
 static int (*ALSA_snd_seq_delete_simple_port)(snd_seq_t *seq, int port);
+static int (*ALSA_snd_seq_disconnect_to)(snd_seq_t *seq, int my_port, int dest_client, int dest_port);
 static int (*ALSA_snd_seq_drain_output)(snd_seq_t *handle);
-static int (*ALSA_snd_seq_drop_output)(snd_seq_t *handle);
 static int (*ALSA_snd_seq_event_input)(snd_seq_t *handle, snd_seq_event_t **ev);
 static int (*ALSA_snd_seq_event_output)(snd_seq_t *handle, snd_seq_event_t *ev);
 static int (*ALSA_snd_seq_event_output_direct)(snd_seq_t *handle, snd_seq_event_t *ev);
 static int (*ALSA_snd_seq_free_queue)(snd_seq_t *handle, int q);
 static int (*ALSA_snd_seq_get_any_client_info)(snd_seq_t *handle, int client, snd_seq_client_info_t *info);
 static int (*ALSA_snd_seq_get_any_port_info)(snd_seq_t *handle, int client, int port, snd_seq_port_info_t *info);
-static int (*ALSA_snd_seq_nonblock)(snd_seq_t *handle, int nonblock);
+static int (*ALSA_snd_seq_get_queue_status)(snd_seq_t *handle, int q, snd_seq_queue_status_t *status);
 static int (*ALSA_snd_seq_open)(snd_seq_t **handle, const char *name, int streams, int mode);
 static int (*ALSA_snd_seq_parse_address)(snd_seq_t *seq, snd_seq_addr_t *addr, const char *str);
 static int (*ALSA_snd_seq_poll_descriptors)(snd_seq_t *handle, struct pollfd *pfds, unsigned int space, short events);
 static unsigned int (*ALSA_snd_seq_port_info_get_capability)(const snd_seq_port_info_t *info);
+static const char *(*ALSA_snd_seq_port_info_get_name)(const snd_seq_port_info_t *info);
 static int (*ALSA_snd_seq_port_info_get_port)(const snd_seq_port_info_t *info);
 static unsigned int (*ALSA_snd_seq_port_info_get_type)(const snd_seq_port_info_t *info);
 static size_t (*ALSA_snd_seq_port_info_sizeof)(void);
 static int (*ALSA_snd_seq_query_next_client)(snd_seq_t *handle, snd_seq_client_info_t *info);
 static int (*ALSA_snd_seq_query_next_port)(snd_seq_t *handle, snd_seq_port_info_t *info);
+static int (*ALSA_snd_seq_queue_status_get_events)(const snd_seq_queue_status_t *info);
+static snd_seq_tick_time_t (*ALSA_snd_seq_queue_status_get_tick_time)(const snd_seq_queue_status_t *info);
+static size_t (*ALSA_snd_seq_queue_status_sizeof)(void);
 static void (*ALSA_snd_seq_queue_tempo_set_ppq)(snd_seq_queue_tempo_t *info, int ppq);
 static void (*ALSA_snd_seq_queue_tempo_set_tempo)(snd_seq_queue_tempo_t *info, unsigned int tempo);
 static size_t (*ALSA_snd_seq_queue_tempo_sizeof)(void);
+static int (*ALSA_snd_seq_remove_events)(snd_seq_t *handle, snd_seq_remove_events_t *info);
+static void (*ALSA_snd_seq_remove_events_set_condition)(snd_seq_remove_events_t *info, unsigned int flags);
+static void (*ALSA_snd_seq_remove_events_set_tag)(snd_seq_remove_events_t *info, int tag);
+static size_t (*ALSA_snd_seq_remove_events_sizeof)(void);
+static int (*ALSA_snd_seq_set_client_pool_output)(snd_seq_t *seq, size_t size);
 static int (*ALSA_snd_seq_set_client_event_filter)(snd_seq_t *seq, int event_type);
 static int (*ALSA_snd_seq_set_client_name)(snd_seq_t *seq, const char *name);
+static int (*ALSA_snd_seq_set_output_buffer_size)(snd_seq_t *handle, size_t size);
 static int (*ALSA_snd_seq_set_queue_tempo)(snd_seq_t *handle, int q, snd_seq_queue_tempo_t *tempo);
 
 static int load_alsa_syms(void)
@@ -148,40 +174,52 @@ static int load_alsa_syms(void)
     SDL_ALSA_SYM(snd_seq_alloc_named_queue);
     SDL_ALSA_SYM(snd_seq_client_id);
     SDL_ALSA_SYM(snd_seq_client_info_get_client);
+    SDL_ALSA_SYM(snd_seq_client_info_get_name);
     SDL_ALSA_SYM(snd_seq_client_info_sizeof);
     SDL_ALSA_SYM(snd_seq_close);
+    SDL_ALSA_SYM(snd_seq_connect_from);
     SDL_ALSA_SYM(snd_seq_connect_to);
     SDL_ALSA_SYM(snd_seq_control_queue);
     SDL_ALSA_SYM(snd_seq_create_simple_port);
     SDL_ALSA_SYM(snd_seq_delete_simple_port);
+    SDL_ALSA_SYM(snd_seq_disconnect_to);
     SDL_ALSA_SYM(snd_seq_drain_output);
-    SDL_ALSA_SYM(snd_seq_drop_output);
     SDL_ALSA_SYM(snd_seq_event_input);
     SDL_ALSA_SYM(snd_seq_event_output);
     SDL_ALSA_SYM(snd_seq_event_output_direct);
     SDL_ALSA_SYM(snd_seq_free_queue);
     SDL_ALSA_SYM(snd_seq_get_any_client_info);
     SDL_ALSA_SYM(snd_seq_get_any_port_info);
-    SDL_ALSA_SYM(snd_seq_nonblock);
+    SDL_ALSA_SYM(snd_seq_get_queue_status);
     SDL_ALSA_SYM(snd_seq_open);
     SDL_ALSA_SYM(snd_seq_parse_address);
     SDL_ALSA_SYM(snd_seq_poll_descriptors);
     SDL_ALSA_SYM(snd_seq_port_info_get_capability);
+    SDL_ALSA_SYM(snd_seq_port_info_get_name);
     SDL_ALSA_SYM(snd_seq_port_info_get_port);
     SDL_ALSA_SYM(snd_seq_port_info_get_type);
     SDL_ALSA_SYM(snd_seq_port_info_sizeof);
     SDL_ALSA_SYM(snd_seq_query_next_client);
     SDL_ALSA_SYM(snd_seq_query_next_port);
+    SDL_ALSA_SYM(snd_seq_queue_status_get_events);
+    SDL_ALSA_SYM(snd_seq_queue_status_get_tick_time);
+    SDL_ALSA_SYM(snd_seq_queue_status_sizeof);
     SDL_ALSA_SYM(snd_seq_queue_tempo_set_ppq);
     SDL_ALSA_SYM(snd_seq_queue_tempo_set_tempo);
     SDL_ALSA_SYM(snd_seq_queue_tempo_sizeof);
+    SDL_ALSA_SYM(snd_seq_remove_events);
+    SDL_ALSA_SYM(snd_seq_remove_events_set_condition);
+    SDL_ALSA_SYM(snd_seq_remove_events_set_tag);
+    SDL_ALSA_SYM(snd_seq_remove_events_sizeof);
     SDL_ALSA_SYM(snd_seq_set_client_event_filter);
     SDL_ALSA_SYM(snd_seq_set_client_name);
+    SDL_ALSA_SYM(snd_seq_set_client_pool_output);
+    SDL_ALSA_SYM(snd_seq_set_output_buffer_size);
     SDL_ALSA_SYM(snd_seq_set_queue_tempo);
     return 0;
 }
 
-#if 1 //ndef NDEBUG
+#ifndef NDEBUG
 #define MIDIDbgLog(...) SDL_Log(__VA_ARGS__)
 #else
 #define MIDIDbgLog(...) \
@@ -206,28 +244,86 @@ typedef enum
     THREAD_CMD_PAUSE,
     THREAD_CMD_RESUME,
     THREAD_CMD_SETVOL,
+    THREAD_CMD_SEEK,
 } native_midi_thread_cmd;
 
+/* Commands go to the player thread through a ring any number of threads can */
+/* add to without locking: a slot is free for whoever claims position pos when */
+/* its seq is pos, and holds a command for the player once seq is pos + 1 */
+#define CMD_RING_SIZE 64
+
+typedef struct
+{
+    SDL_AtomicU32 seq;
+    Uint8 cmd; /* Stores a native_midi_thread_cmd */
+} native_midi_cmd_slot;
+
+/* A decoded song lowered to ALSA events. Nothing in there is up to the song */
+/* playing it, so songs playing the same list, as handed out by the cache, */
+/* share them. Every song holds a reference to the list, so the list (and */
+/* with it, the key) stays around for as long as the events do */
+typedef struct native_midi_lowered
+{
+    struct native_midi_lowered *next;
+    const MIDIEventList *list;
+    int refcount; /* Songs using these; guarded by lowered_lock */
+    size_t size; /* Of the whole allocation, this included */
+    snd_seq_event_t *events; /* One for each of list's, then the SysEx messages, F0 and all */
+} native_midi_lowered;
+
 struct NativeMidi_Song
 {
     SDL_Thread *playerthread;
-    int mainsock, threadsock;
+    SDL_Mutex *lock; /* Keeps starting, stopping and destroying the song apart */
+    SDL_AtomicInt users; /* Global controls working on the song as currentsong */
+    int cmdfd; /* eventfd the player thread is woken up with */
+    SDL_AtomicInt cmdwakeup; /* Set while a wakeup is on its way */
+    SDL_AtomicU32 cmdhead; /* Next position to claim in cmds; only the player thread uses cmdtail */
+    Uint32 cmdtail;
+    native_midi_cmd_slot cmds[CMD_RING_SIZE];
+    SDL_AtomicInt volume; /* Volume to set, 0 to 0x7F; taken along by THREAD_CMD_SETVOL */
+    SDL_AtomicInt volpending; /* Set while a THREAD_CMD_SETVOL is on its way */
     Uint16 ppqn;
-    MIDIEvent *evtlist;
-    snd_seq_t *seq;
+    MIDIEventList *evtlist; /* Either the whole song is decoded up front... */
+    MIDIEventStream *stream; /* ...or it is decoded while playing */
+    native_midi_lowered *lowered; /* Decoded songs as ALSA events, shared with other songs */
+    Uint8 *sysexbuf; /* Room for SysEx messages of streams, plus the F0 ALSA wants in front */
+    Uint32 sysexbuflen;
+    snd_seq_t *seq; /* The shared client, its port and where that's connected to */
     int srcport;
     snd_seq_addr_t dstaddr;
-    int loopcount;
-    Uint32 endtime;
+    int loopcount; /* Set before the player thread starts, only used by it after */
+    /* Looping songs queue each time around right behind the last, so the queue */
+    /* never runs dry. These are the ticks the time around being queued and the */
+    /* one before it start at; only the player thread uses them */
+    Uint32 loopstart;
+    Uint32 prevloopstart;
     SDL_AtomicInt playerstate; /* Stores a native_midi_state */
+    SDL_AtomicInt seektick; /* Where to continue from next, -1 if nowhere in particular */
+    SDL_AtomicInt stalls; /* Times the player found the sequencer full */
+    /* Where the queue was last seen, for NativeMidi_GetPosition. Only the */
+    /* player thread writes these, and readers retry while posseq is odd */
+    /* or has changed under them, so nobody ever waits on anybody. */
+    SDL_AtomicInt posseq;
+    Uint32 postick;
+    Uint64 posstamp; /* SDL_GetTicksNS() when postick was read, 0 if the queue isn't moving */
     bool allow_pause;
+    Uint32 lookahead; /* Milliseconds of the song kept queued ahead, 0 for as much as fits */
 };
 
-/* Fixed length command packets */
-#define CMD_PKT_LEN 2
-static const unsigned char pkt_thread_cmd_quit[CMD_PKT_LEN] = { THREAD_CMD_QUIT };
-static const unsigned char pkt_thread_cmd_pause[CMD_PKT_LEN] = { THREAD_CMD_PAUSE };
-static const unsigned char pkt_thread_cmd_resume[CMD_PKT_LEN] = { THREAD_CMD_RESUME };
+/* How often the player thread looks at where the queue is */
+#define POSITION_UPDATE_MS 50
+
+/* Unless told otherwise, the kernel pool gets room for about this many seconds */
+/* of a song, within the limits below. The kernel takes no more than 2000 */
+#define SEQ_POOL_SECONDS 2
+#define SEQ_POOL_MIN     500
+#define SEQ_POOL_MAX     2000
+
+/* The output buffer holds half the pool, but no less than the alsa-lib default */
+#define SEQ_BUFFER_MIN   (16 * 1024)
+#define SEQ_BUFFER_MAX   (64 * 1024)
+
 
 static SDL_INLINE const char *get_app_name_hint(void)
 {
@@ -296,7 +392,7 @@ static snd_seq_t *open_seq(int *srcport_out)
         return NULL;
     }
 
-    if ((ret = ALSA_snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, 0)) < 0) {
+    if ((ret = ALSA_snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK)) < 0) {
         SDL_SetError("snd_seq_open returned %d", ret);
         return NULL;
     }
@@ -309,6 +405,13 @@ static snd_seq_t *open_seq(int *srcport_out)
 
     ALSA_snd_seq_set_client_name(seq, seq_name);
 
+    /* All we ever read is news of clients and ports coming and going */
+    ALSA_snd_seq_set_client_event_filter(seq, SND_SEQ_EVENT_CLIENT_START);
+    ALSA_snd_seq_set_client_event_filter(seq, SND_SEQ_EVENT_CLIENT_EXIT);
+    ALSA_snd_seq_set_client_event_filter(seq, SND_SEQ_EVENT_PORT_START);
+    ALSA_snd_seq_set_client_event_filter(seq, SND_SEQ_EVENT_PORT_EXIT);
+    ALSA_snd_seq_set_client_event_filter(seq, SND_SEQ_EVENT_PORT_CHANGE);
+
     if ((ret = ALSA_snd_seq_create_simple_port(seq, seq_name,
                                                SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_READ | SND_SEQ_PORT_CAP_SYNC_READ,
                                                SND_SEQ_PORT_TYPE_APPLICATION | SND_SEQ_PORT_TYPE_MIDI_GENERIC)) < 0) {
@@ -332,82 +435,211 @@ static void close_seq(snd_seq_t *seq, const int port)
     unload_alsa_library();
 }
 
-bool NativeMidi_Init(void)
+static bool init_song_controls(NativeMidi_Song *song)
 {
-    int port;
-    snd_seq_t *seq_temp = open_seq(&port);
-    if (!seq_temp) {
-        return 0;
+    Uint32 i;
+
+    song->cmdfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (song->cmdfd == -1) {
+        return SDL_SetError("Failed to create eventfd with errno %d", errno);
     }
-    close_seq(seq_temp, port);
-    return 1;
+    song->lock = SDL_CreateMutex();
+    if (!song->lock) {
+        close(song->cmdfd);
+        return false;
+    }
+    for (i = 0; i < CMD_RING_SIZE; i++) {
+        SDL_SetAtomicU32(&song->cmds[i].seq, i);
+    }
+    SDL_SetAtomicInt(&song->volume, 0x7F);
+    return true;
 }
 
-void NativeMidi_Quit(void)
+static void free_song_controls(NativeMidi_Song *song)
+{
+    SDL_DestroyMutex(song->lock);
+    close(song->cmdfd);
+}
+
+/* Hand a command to the player thread, and wake it up unless that's under way. */
+/* This returns false if the ring is full */
+static bool push_cmd(NativeMidi_Song *song, const native_midi_thread_cmd cmd)
 {
+    const Uint64 one = 1;
+    native_midi_cmd_slot *slot;
+    Uint32 pos;
+
+    while (1) {
+        Sint32 diff;
+
+        pos = SDL_GetAtomicU32(&song->cmdhead);
+        slot = &song->cmds[pos % CMD_RING_SIZE];
+        diff = (Sint32)(SDL_GetAtomicU32(&slot->seq) - pos);
+        if (diff < 0) {
+            return false;
+        } else if (diff == 0 && SDL_CompareAndSwapAtomicU32(&song->cmdhead, pos, pos + 1)) {
+            break;
+        }
+        /* Someone else claimed pos first; try the next one */
+    }
+    slot->cmd = (Uint8)cmd;
+    SDL_SetAtomicU32(&slot->seq, pos + 1);
+
+    if (SDL_CompareAndSwapAtomicInt(&song->cmdwakeup, 0, 1)) {
+        (void)!write(song->cmdfd, &one, sizeof(one));
+    }
+    return true;
 }
 
-static void close_sockpair(NativeMidi_Song *song)
+/* Hand a command to the player thread, waiting for room while it's running */
+static void send_cmd(NativeMidi_Song *song, const native_midi_thread_cmd cmd)
 {
-    shutdown(song->mainsock, SHUT_RDWR);
-    shutdown(song->threadsock, SHUT_RDWR);
-    close(song->mainsock);
-    close(song->threadsock);
+    while (!push_cmd(song, cmd) && SDL_GetAtomicInt(&song->playerstate) > NATIVE_MIDI_STOPPED) {
+        SDL_Delay(1);
+    }
 }
 
-static SDL_INLINE int subscribe_to_first_available_port(snd_seq_t *seq, const int srcport, const unsigned int required_type)
+/* Take the next command off the ring; player thread only. This returns false */
+/* if there is none */
+static bool pop_cmd(NativeMidi_Song *song, native_midi_thread_cmd *cmd)
 {
-    snd_seq_client_info_t *clientinfo;
-    snd_seq_client_info_alloca(&clientinfo);
+    native_midi_cmd_slot *slot = &song->cmds[song->cmdtail % CMD_RING_SIZE];
 
-    /* Query System to fill the struct initially */
-    if (ALSA_snd_seq_get_any_client_info(seq, 0, clientinfo)) {
-        return -1;
+    if (SDL_GetAtomicU32(&slot->seq) != song->cmdtail + 1) {
+        return false;
     }
+    *cmd = (native_midi_thread_cmd)slot->cmd;
+    SDL_SetAtomicU32(&slot->seq, song->cmdtail + CMD_RING_SIZE);
+    song->cmdtail++;
+    return true;
+}
 
-    while (ALSA_snd_seq_query_next_client(seq, clientinfo) == 0) {
-        const int client = ALSA_snd_seq_client_info_get_client(clientinfo);
+/* A port songs can be played on */
+typedef struct
+{
+    snd_seq_addr_t addr;
+    unsigned int type;
+    char name[128];
+} seq_destination;
+
+/* Every port songs can be played on, as of the last look around. The System */
+/* announce port tells us when clients and ports come and go, and only then do */
+/* we look again. Only used with seq_mutex held (see below) */
+static seq_destination *seq_dests = NULL;
+static int seq_ndests = 0;
+static snd_seq_addr_t seq_selected; /* Picked with NativeMidi_SelectDestination, client 0 if none */
+static snd_seq_addr_t seq_connected; /* Where our port is connected to, client 0 if nowhere */
+
+static SDL_INLINE bool same_addr(const snd_seq_addr_t *a, const snd_seq_addr_t *b)
+{
+    return a->client == b->client && a->port == b->port;
+}
 
-        /* Not necessary, as we don't allow subscription to our ports, but let's ignore ourselves anyway */
-        if (client == ALSA_snd_seq_client_id(seq)) {
-            continue;
+static const seq_destination *find_destination(const snd_seq_addr_t *addr)
+{
+    int i;
+
+    for (i = 0; i < seq_ndests; i++) {
+        if (same_addr(&seq_dests[i].addr, addr)) {
+            return &seq_dests[i];
         }
+    }
+    return NULL;
+}
 
-        snd_seq_port_info_t *portinfo;
-        snd_seq_port_info_alloca(&portinfo);
+/* Walk every client and port there is, and remember those we can play on */
+static void scan_destinations(snd_seq_t *seq)
+{
+    snd_seq_client_info_t *clientinfo;
+    snd_seq_port_info_t *portinfo;
+    seq_destination *dests = NULL;
+    int ndests = 0;
 
-        /* Start with port 0 */
-        if (ALSA_snd_seq_get_any_port_info(seq, client, 0, portinfo)) {
-            continue;
-        }
+    snd_seq_client_info_alloca(&clientinfo);
+    snd_seq_port_info_alloca(&portinfo);
 
-        do {
-            const int port = ALSA_snd_seq_port_info_get_port(portinfo);
-            const unsigned int cap = ALSA_snd_seq_port_info_get_capability(portinfo);
-            const unsigned int type = ALSA_snd_seq_port_info_get_type(portinfo);
+    /* Query System to fill the struct initially */
+    if (ALSA_snd_seq_get_any_client_info(seq, 0, clientinfo) == 0) {
+        while (ALSA_snd_seq_query_next_client(seq, clientinfo) == 0) {
+            const int client = ALSA_snd_seq_client_info_get_client(clientinfo);
 
-            if ((type & required_type) == required_type &&
-                cap & SND_SEQ_PORT_CAP_WRITE &&
-                cap & SND_SEQ_PORT_CAP_SUBS_WRITE &&
-                !(cap & SND_SEQ_PORT_CAP_NO_EXPORT)) {
+            /* Not necessary, as we don't allow subscription to our ports, but let's ignore ourselves anyway */
+            if (client == ALSA_snd_seq_client_id(seq)) {
+                continue;
+            }
 
-                MIDIDbgLog("Client %d Cap %x Type %x", client, cap, type);
+            /* Start with port 0 */
+            if (ALSA_snd_seq_get_any_port_info(seq, client, 0, portinfo)) {
+                continue;
+            }
+
+            do {
+                const unsigned int cap = ALSA_snd_seq_port_info_get_capability(portinfo);
+                const unsigned int type = ALSA_snd_seq_port_info_get_type(portinfo);
+                seq_destination *dest;
 
-                /* Could we connect to it? */
-                if (ALSA_snd_seq_connect_to(seq, srcport, client, port) == 0) {
-                    return 0;
+                if (!(type & SND_SEQ_PORT_TYPE_MIDI_GENERIC) ||
+                    !(cap & SND_SEQ_PORT_CAP_WRITE) ||
+                    !(cap & SND_SEQ_PORT_CAP_SUBS_WRITE) ||
+                    (cap & SND_SEQ_PORT_CAP_NO_EXPORT)) {
+                    continue;
                 }
-            }
-        } while (ALSA_snd_seq_query_next_port(seq, portinfo) == 0);
+
+                dest = (seq_destination *)SDL_realloc(dests, (ndests + 1) * sizeof(*dests));
+                if (!dest) {
+                    break;
+                }
+                dests = dest;
+                dest = &dests[ndests++];
+                dest->addr.client = (unsigned char)client;
+                dest->addr.port = (unsigned char)ALSA_snd_seq_port_info_get_port(portinfo);
+                dest->type = type;
+                SDL_snprintf(dest->name, sizeof(dest->name), "%s: %s", ALSA_snd_seq_client_info_get_name(clientinfo), ALSA_snd_seq_port_info_get_name(portinfo));
+
+                MIDIDbgLog("Client %d Cap %x Type %x", client, cap, type);
+            } while (ALSA_snd_seq_query_next_port(seq, portinfo) == 0);
+        }
     }
-    return 1;
+
+    SDL_free(seq_dests);
+    seq_dests = dests;
+    seq_ndests = ndests;
 }
 
-static SDL_INLINE void pick_seq_dest_addr(NativeMidi_Song *song)
+static bool connect_destination(snd_seq_t *seq, const int srcport, const snd_seq_addr_t *addr)
 {
-    /* Send events to all subscribers */
-    song->dstaddr.client = SND_SEQ_ADDRESS_SUBSCRIBERS;
-    song->dstaddr.port = SND_SEQ_ADDRESS_UNKNOWN;
+    if (ALSA_snd_seq_connect_to(seq, srcport, addr->client, addr->port) < 0) {
+        return false;
+    }
+    seq_connected = *addr;
+    return true;
+}
+
+/* Make sure our port is connected where it should be: to the destination that was */
+/* picked if it's there, or else to where it already is, or else somewhere sensible */
+static void update_connection(snd_seq_t *seq, const int srcport)
+{
+    snd_seq_addr_t conn_addr;
+    int i;
+
+    if (seq_selected.client && find_destination(&seq_selected)) {
+        if (seq_connected.client && same_addr(&seq_connected, &seq_selected)) {
+            return;
+        }
+    } else if (seq_connected.client && find_destination(&seq_connected)) {
+        return;
+    }
+
+    /* A port that went away took its connection along */
+    if (seq_connected.client) {
+        ALSA_snd_seq_disconnect_to(seq, srcport, seq_connected.client, seq_connected.port);
+        SDL_zero(seq_connected);
+    }
+
+    if (seq_selected.client && find_destination(&seq_selected)) {
+        connect_destination(seq, srcport, &seq_selected);
+        return;
+    }
 
     /* Connect us somewhere, unless it's not desired */
     if (SDL_GetHintBoolean("SDL_NATIVE_MIDI_NO_CONNECT_PORTS", false)) {
@@ -415,146 +647,683 @@ static SDL_INLINE void pick_seq_dest_addr(NativeMidi_Song *song)
     }
 
     /* If ALSA_OUTPUT_PORTS is specified, try to parse it and connect to it */
-    snd_seq_addr_t conn_addr;
     const char *ports_env = SDL_getenv("ALSA_OUTPUT_PORTS");
-    if (ports_env && ALSA_snd_seq_parse_address(song->seq, &conn_addr, ports_env) == 0) {
-        if (ALSA_snd_seq_connect_to(song->seq, song->srcport, conn_addr.client, conn_addr.port) == 0) {
+    if (ports_env && ALSA_snd_seq_parse_address(seq, &conn_addr, ports_env) == 0) {
+        if (connect_destination(seq, srcport, &conn_addr)) {
             return;
         }
     }
 
     /* If we're not connecting to a specific client, pick the first one available after System (0) */
     /* Prefer connecting to synthesizers, as that is the primary use case */
-    if (!subscribe_to_first_available_port(song->seq, song->srcport, SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_SYNTHESIZER)) {
-        return;
+    for (i = 0; i < seq_ndests; i++) {
+        if ((seq_dests[i].type & SND_SEQ_PORT_TYPE_SYNTHESIZER) && connect_destination(seq, srcport, &seq_dests[i].addr)) {
+            return;
+        }
     }
     /* If we can't find a synth, then pick the first available port */
-    if (!subscribe_to_first_available_port(song->seq, song->srcport, SND_SEQ_PORT_TYPE_MIDI_GENERIC)) {
+    for (i = 0; i < seq_ndests; i++) {
+        if (connect_destination(seq, srcport, &seq_dests[i].addr)) {
+            return;
+        }
+    }
+}
+
+/* Catch up on what the System announce port has told us, and look around again */
+/* if anything came or went since the last time */
+static void refresh_destinations(snd_seq_t *seq, const int srcport)
+{
+    snd_seq_event_t *ev;
+    bool changed = false;
+    int rc;
+
+    while ((rc = ALSA_snd_seq_event_input(seq, &ev)) >= 0 || rc == -ENOSPC) {
+        /* If we fell so far behind that announcements were lost, assume the worst */
+        if (rc == -ENOSPC) {
+            changed = true;
+            continue;
+        }
+        switch (ev->type) {
+        case SND_SEQ_EVENT_CLIENT_START:
+        case SND_SEQ_EVENT_CLIENT_EXIT:
+        case SND_SEQ_EVENT_PORT_START:
+        case SND_SEQ_EVENT_PORT_EXIT:
+        case SND_SEQ_EVENT_PORT_CHANGE:
+            changed = true;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (changed) {
+        scan_destinations(seq);
+        update_connection(seq, srcport);
+    }
+}
+
+/* All songs share one sequencer client and port, and each plays on a queue of its */
+/* own. The client is opened by NativeMidi_Init or the first song loaded, and closed */
+/* by NativeMidi_Quit or with the last song destroyed, whichever comes later. */
+/* alsa-lib handles aren't thread safe, so whoever uses the client holds seq_mutex. */
+/* Opening the client loads the library and looks at every port, which takes */
+/* too long to have other threads spin on; the mutex that keeps opening and */
+/* closing apart is created once and kept for good */
+static SDL_InitState seq_lock_init;
+static SDL_Mutex *seq_lock = NULL;
+static int seq_refcount = 0;
+static SDL_AtomicInt seq_initialized; /* NativeMidi_Init holds a reference */
+static snd_seq_t *shared_seq = NULL;
+static int shared_port;
+static SDL_Mutex *seq_mutex = NULL;
+static size_t seq_pool; /* What the kernel pool and output buffer are set to */
+static size_t seq_buffer;
+static size_t seq_want_pool; /* What the songs loaded so far want them to be */
+static size_t seq_want_buffer;
+static int seq_queues; /* Queues of songs that are playing */
+
+static bool lock_seq(void)
+{
+    if (SDL_ShouldInit(&seq_lock_init)) {
+        seq_lock = SDL_CreateMutex();
+        SDL_SetInitialized(&seq_lock_init, seq_lock != NULL);
+    }
+    if (!seq_lock) {
+        return false;
+    }
+    SDL_LockMutex(seq_lock);
+    return true;
+}
+
+static bool acquire_seq(void)
+{
+    bool result = true;
+
+    if (!lock_seq()) {
+        return false;
+    }
+    if (seq_refcount == 0) {
+        seq_mutex = SDL_CreateMutex();
+        if (!seq_mutex || !(shared_seq = open_seq(&shared_port))) {
+            SDL_DestroyMutex(seq_mutex);
+            seq_mutex = NULL;
+            result = false;
+        } else {
+            /* Hear about ports coming and going from here on, then look around once */
+            ALSA_snd_seq_connect_from(shared_seq, shared_port, SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE);
+            scan_destinations(shared_seq);
+            SDL_zero(seq_connected);
+            update_connection(shared_seq, shared_port);
+            seq_pool = 0;
+            seq_buffer = 0;
+            seq_want_pool = 0;
+            seq_want_buffer = 0;
+            seq_queues = 0;
+        }
+    }
+    if (result) {
+        seq_refcount++;
+    }
+    SDL_UnlockMutex(seq_lock);
+    return result;
+}
+
+static void release_seq(void)
+{
+    if (!lock_seq()) {
         return;
     }
+    if (seq_refcount > 0 && --seq_refcount == 0) {
+        close_seq(shared_seq, shared_port);
+        shared_seq = NULL;
+        SDL_DestroyMutex(seq_mutex);
+        seq_mutex = NULL;
+        SDL_free(seq_dests);
+        seq_dests = NULL;
+        seq_ndests = 0;
+    }
+    SDL_UnlockMutex(seq_lock);
+}
+
+bool NativeMidi_Init(void)
+{
+    /* Keep the client around until NativeMidi_Quit, so loading songs doesn't have to open it */
+    if (SDL_GetAtomicInt(&seq_initialized)) {
+        return true;
+    }
+    if (!acquire_seq()) {
+        return false;
+    }
+    if (!SDL_CompareAndSwapAtomicInt(&seq_initialized, 0, 1)) {
+        /* Somebody else got there first */
+        release_seq();
+    }
+    return true;
+}
+
+void NativeMidi_Quit(void)
+{
+    if (SDL_CompareAndSwapAtomicInt(&seq_initialized, 1, 0)) {
+        release_seq();
+    }
+    NativeMidi_ClearCache();
 }
 
+/* The song the global controls (pause, volume...) act on: the last one started. */
+/* They hold it as one of its users, which NativeMidi_DestroySong waits out */
 static NativeMidi_Song *currentsong = NULL;
+static SDL_SpinLock currentsong_lock;
 
-NativeMidi_Song *NativeMidi_LoadSong_IO(SDL_IOStream *src, bool closeio)
+static NativeMidi_Song *get_current_song(void)
 {
     NativeMidi_Song *song;
-    MIDIEvent *event;
-    int sv[2];
 
-    if (!(song = SDL_calloc(1, sizeof(NativeMidi_Song)))) {
-        return NULL;
+    SDL_LockSpinlock(&currentsong_lock);
+    song = currentsong;
+    if (song) {
+        SDL_AddAtomicInt(&song->users, 1);
+    }
+    SDL_UnlockSpinlock(&currentsong_lock);
+    return song;
+}
+
+static void put_current_song(NativeMidi_Song *song)
+{
+    if (song) {
+        SDL_AddAtomicInt(&song->users, -1);
     }
+}
 
-    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) == -1) {
-        SDL_SetError("Failed to create socketpair with errno %d", errno);
-        SDL_free(song);
-        return NULL;
+/* Make sure a SysEx message of len bytes (without the F0) fits into sysexbuf */
+static bool reserve_sysexbuf(NativeMidi_Song *song, Uint32 len)
+{
+    Uint8 *buf;
+
+    if (len < song->sysexbuflen) {
+        return true;
+    }
+    if (!(buf = NativeMidi_realloc(song->sysexbuf, len + 1))) {
+        return false;
     }
+    song->sysexbuf = buf;
+    song->sysexbuflen = len + 1;
+    return true;
+}
 
-    song->mainsock = sv[0];
-    song->threadsock = sv[1];
+static SDL_SpinLock lowered_lock;
+static native_midi_lowered *lowered_head = NULL;
 
-    event = song->evtlist = NativeMidi_CreateMIDIEventList(src, &song->ppqn);
+/* Find the lowered events of a list and take a reference. Call with lowered_lock held */
+static native_midi_lowered *find_lowered(const MIDIEventList *list)
+{
+    native_midi_lowered *lowered;
 
-    if (!song->evtlist) {
-        close_sockpair(song);
-        SDL_free(song);
-        SDL_SetError("Failed to create MIDIEventList");
-        return NULL;
+    for (lowered = lowered_head; lowered; lowered = lowered->next) {
+        if (lowered->list == list) {
+            lowered->refcount++;
+            return lowered;
+        }
     }
+    return NULL;
+}
 
-    /* Since ALSA requires the starting F0 for SysEx, but MIDIEvent.extraData doesn't contain it, we must preprocess the list */
-    /* In addition, since we're going through the list, store the last event's time for looping purposes */
-    do {
-        /* Is this a SysEx? */
-        if (event->status == MIDI_CMD_COMMON_SYSEX && event->extraLen) {
-            /* Sanity check in case something changes in the future */
-            /* This is safe to do since we can't have an F0 manufacturer ID */
-            SDL_assert(event->extraData[0] != MIDI_CMD_COMMON_SYSEX);
-
-            /* Resize by + 1 */
-            Uint8 *newData = SDL_realloc(event->extraData, event->extraLen + 1);
-            if (newData == NULL) {
-                close_sockpair(song);
-                /* Original allocation is still valid on failure */
-                NativeMidi_FreeMIDIEventList(song->evtlist);
-                SDL_free(song);
-                SDL_SetError("Failed to preprocess MIDIEventList SysEx");
-                return NULL;
+/* This has to go before the list does, as another list could take its place */
+static void release_lowered(native_midi_lowered *lowered)
+{
+    native_midi_lowered **prev;
+    bool last;
+
+    if (!lowered) {
+        return;
+    }
+    SDL_LockSpinlock(&lowered_lock);
+    last = (--lowered->refcount == 0);
+    if (last) {
+        prev = &lowered_head;
+        while (*prev != lowered) {
+            prev = &(*prev)->next;
+        }
+        *prev = lowered->next;
+    }
+    SDL_UnlockSpinlock(&lowered_lock);
+
+    if (last) {
+        NativeMidi_free(lowered);
+    }
+}
+
+static void free_song_events(NativeMidi_Song *song)
+{
+    release_lowered(song->lowered);
+    NativeMidi_FreeMIDIEventList(song->evtlist);
+    NativeMidi_FreeMIDIEventStream(song->stream);
+    NativeMidi_free(song->sysexbuf);
+}
+
+/* Turn a MIDI event into the ALSA event that plays it on queue. SysEx messages */
+/* are put together in sysex, which needs room for the F0 ALSA wants in front. */
+/* Events ALSA doesn't get to see come out as SND_SEQ_EVENT_NONE. */
+static void lower_event(const NativeMidi_Song *song, snd_seq_event_t *evt, const int queue, const MIDIEvent *event, const Uint8 *extra, Uint8 *sysex)
+{
+    const unsigned char cmd = event->status & 0xF0;
+    const unsigned char channel = event->status & 0x0F;
+
+    snd_seq_ev_clear(evt);
+    snd_seq_ev_set_source(evt, song->srcport);
+    snd_seq_ev_set_dest(evt, song->dstaddr.client, song->dstaddr.port);
+    snd_seq_ev_set_fixed(evt);
+    snd_seq_ev_set_tag(evt, queue);
+    snd_seq_ev_schedule_tick(evt, queue, 0, event->time);
+
+    switch (cmd) {
+
+    case MIDI_CMD_NOTE_ON:
+        snd_seq_ev_set_noteon(evt, channel, event->data[0], event->data[1]);
+        return;
+
+    case MIDI_CMD_NOTE_OFF:
+        snd_seq_ev_set_noteoff(evt, channel, event->data[0], event->data[1]);
+        return;
+
+    case MIDI_CMD_CONTROL:
+        snd_seq_ev_set_controller(evt, channel, event->data[0], event->data[1]);
+        return;
+
+    case MIDI_CMD_NOTE_PRESSURE:
+        snd_seq_ev_set_keypress(evt, channel, event->data[0], event->data[1]);
+        return;
+
+    case MIDI_CMD_PGM_CHANGE:
+        snd_seq_ev_set_pgmchange(evt, channel, event->data[0]);
+        return;
+
+    case MIDI_CMD_BENDER:
+        snd_seq_ev_set_pitchbend(evt, channel, ((((int)event->data[1]) << 7) | (event->data[0] & 0x7F)) - 8192);
+        return;
+
+    default:
+        if (event->status == MIDI_SMF_META_EVENT) {
+            if (event->data[0] == MIDI_SMF_META_TEMPO && event->extraLen == 3) {
+                unsigned int t = ((unsigned)extra[0] << 16) |
+                                 ((unsigned)extra[1] << 8) |
+                                 extra[2];
+
+                /* This goes to the system timer rather than the destination */
+                snd_seq_ev_set_queue_tempo(evt, queue, t);
+                return;
             }
+        } else if (event->status == MIDI_CMD_COMMON_SYSEX && event->extraLen && sysex) {
+            sysex[0] = MIDI_CMD_COMMON_SYSEX;
+            SDL_memcpy(sysex + 1, extra, event->extraLen);
+            snd_seq_ev_set_sysex(evt, event->extraLen + 1, sysex);
+            return;
+        }
+        evt->type = SND_SEQ_EVENT_NONE;
+        break;
+    }
+}
+
+/* Lower every event of a decoded song up front, so the player thread only has */
+/* to hand them to ALSA, unless another song playing the same list did already. */
+/* The events and SysEx messages go right after the bookkeeping, in the same */
+/* allocation. The queue isn't known until the song plays, so the player fills */
+/* that (and the tag that goes with it) in, along with the song's addresses. */
+static bool lower_song_events(NativeMidi_Song *song)
+{
+    const MIDIEventList *list = song->evtlist;
+    native_midi_lowered *lowered;
+    native_midi_lowered *found;
+    size_t sysexlen = 0;
+    size_t size;
+    Uint8 *sysex;
+    Uint32 i;
+
+    SDL_LockSpinlock(&lowered_lock);
+    song->lowered = find_lowered(list);
+    SDL_UnlockSpinlock(&lowered_lock);
+    if (song->lowered) {
+        return true;
+    }
+
+    for (i = 0; i < list->nEvents; i++) {
+        if (list->events[i].status == MIDI_CMD_COMMON_SYSEX && list->events[i].extraLen) {
+            sysexlen += (size_t)list->events[i].extraLen + 1;
+        }
+    }
+
+    size = sizeof(native_midi_lowered) + list->nEvents * sizeof(snd_seq_event_t) + sysexlen;
+    lowered = NativeMidi_malloc(size);
+    if (!lowered) {
+        return false;
+    }
+    lowered->list = list;
+    lowered->refcount = 1;
+    lowered->size = size;
+    lowered->events = (snd_seq_event_t *)(lowered + 1);
+
+    sysex = (Uint8 *)(lowered->events + list->nEvents);
+    for (i = 0; i < list->nEvents; i++) {
+        const MIDIEvent *event = &list->events[i];
+
+        lower_event(song, &lowered->events[i], 0, event, NativeMidi_GetExtraData(list, event), sysex);
+        if (lowered->events[i].type == SND_SEQ_EVENT_SYSEX) {
+            sysex += event->extraLen + 1;
+        }
+    }
+
+    /* Another song may have gotten there first meanwhile */
+    SDL_LockSpinlock(&lowered_lock);
+    found = find_lowered(list);
+    if (!found) {
+        lowered->next = lowered_head;
+        lowered_head = lowered;
+    }
+    SDL_UnlockSpinlock(&lowered_lock);
+
+    if (found) {
+        NativeMidi_free(lowered);
+        lowered = found;
+    }
+    song->lowered = lowered;
+    return true;
+}
+
+/* Grow the kernel pool and output buffer to what the songs want. Neither may */
+/* change while queues are playing, so that waits until none is: either until */
+/* the next song is loaded, or until the next player starts. The caller holds */
+/* seq_mutex */
+static void apply_seq_sizes(snd_seq_t *seq)
+{
+    if (seq_queues > 0) {
+        return;
+    }
+    if (seq_want_pool > seq_pool) {
+        if (ALSA_snd_seq_set_client_pool_output(seq, seq_want_pool) == 0) {
+            seq_pool = seq_want_pool;
+        } else {
+            MIDIDbgLog("Couldn't set the output pool to %zu events", seq_want_pool);
+            seq_want_pool = seq_pool;
+        }
+    }
+    if (seq_want_buffer > seq_buffer) {
+        if (ALSA_snd_seq_set_output_buffer_size(seq, seq_want_buffer) == 0) {
+            seq_buffer = seq_want_buffer;
+        } else {
+            MIDIDbgLog("Couldn't set the output buffer to %zu bytes", seq_want_buffer);
+            seq_want_buffer = seq_buffer;
+        }
+    }
+}
 
-            /* Prepend the F0 */
-            event->extraData = newData;
-            SDL_memmove(event->extraData + 1, event->extraData, event->extraLen);
-            event->extraData[0] = MIDI_CMD_COMMON_SYSEX;
-            event->extraLen++;
+static size_t get_size_hint(const char *name)
+{
+    const char *hint = SDL_GetHint(name);
+    return (hint && *hint) ? (size_t)SDL_strtoul(hint, NULL, 0) : 0;
+}
+
+/* Size the output buffer and the kernel pool for how dense the song is, so */
+/* that busy songs don't keep running into a full sequencer. Both belong to the */
+/* shared client, so they only ever grow, and only while they aren't in use: */
+/* the kernel won't resize a pool with events in it, and alsa-lib throws away */
+/* what's buffered when the buffer is resized */
+static void size_seq_buffers(NativeMidi_Song *song)
+{
+    NativeMidi_SongStats stats;
+    const MIDITimeMap *map = NULL;
+    Uint32 maxsysex = 0;
+    size_t pool, buffer;
+    Uint64 length;
+
+    SDL_zero(stats);
+    if (song->evtlist) {
+        stats.events = song->evtlist->nEvents;
+        map = &song->evtlist->time;
+        maxsysex = song->evtlist->maxSysexLen;
+    } else {
+        /* Midifiles being streamed have no count, and aren't scanned just for this */
+        NativeMidi_AddMIDIEventStreamStats(song->stream, &stats);
+        if (stats.events) {
+            map = NativeMidi_GetMIDIEventStreamTimeMap(song->stream);
         }
+    }
 
-        /* Store the end time */
-        song->endtime = event->time;
-    } while ((event = event->next));
+    pool = SDL_min(get_size_hint("SDL_NATIVE_MIDI_ALSA_POOL_SIZE"), SEQ_POOL_MAX);
+    if (!pool) {
+        pool = SEQ_POOL_MIN;
+        length = map ? NativeMidi_MapTicksToMicroseconds(map, map->endTime) : 0;
+        if (length) {
+            pool = (size_t)SDL_min((Uint64)stats.events * SEQ_POOL_SECONDS * SDL_US_PER_SECOND / length, SEQ_POOL_MAX);
+        }
+        pool = SDL_clamp(pool, SEQ_POOL_MIN, SEQ_POOL_MAX);
+    }
 
-    if (!(song->seq = open_seq(&song->srcport))) {
-        NativeMidi_FreeMIDIEventList(song->evtlist);
-        close_sockpair(song);
-        SDL_free(song);
+    buffer = get_size_hint("SDL_NATIVE_MIDI_ALSA_BUFFER_SIZE");
+    if (!buffer) {
+        buffer = SDL_clamp(pool * sizeof(snd_seq_event_t) / 2, SEQ_BUFFER_MIN, SEQ_BUFFER_MAX);
+    }
+
+    /* The longest SysEx message has to fit in one piece, F0 and all */
+    buffer = SDL_max(buffer, sizeof(snd_seq_event_t) + maxsysex + 1);
+
+    SDL_LockMutex(seq_mutex);
+    seq_want_pool = SDL_max(seq_want_pool, pool);
+    seq_want_buffer = SDL_max(seq_want_buffer, buffer);
+    apply_seq_sizes(song->seq);
+    SDL_UnlockMutex(seq_mutex);
+}
+
+NativeMidi_Song *NativeMidi_LoadSong_IO(SDL_IOStream *src, bool closeio)
+{
+    NativeMidi_Song *song;
+
+    if (!(song = NativeMidi_calloc(1, sizeof(NativeMidi_Song)))) {
         return NULL;
     }
 
-    /* Only allow echo events to be sent */
-    ALSA_snd_seq_set_client_event_filter(song->seq, SND_SEQ_EVENT_ECHO);
+    if (!init_song_controls(song)) {
+        NativeMidi_free(song);
+        return NULL;
+    }
 
-    pick_seq_dest_addr(song);
+    /* Streaming starts faster and keeps memory use flat for long songs, */
+    /* at the cost of decoding on the player thread */
+    if (SDL_GetHintBoolean("SDL_NATIVE_MIDI_STREAMING", false)) {
+        song->stream = NativeMidi_CreateMIDIEventStream(src, &song->ppqn);
+    } else {
+        song->evtlist = NativeMidi_CreateMIDIEventList(src, &song->ppqn);
+
+        /* Songs that mostly sit around loaded can be kept packed instead */
+        if (song->evtlist && SDL_GetHintBoolean("SDL_NATIVE_MIDI_COMPACT", false)) {
+            song->stream = NativeMidi_CompactMIDIEventList(song->evtlist);
+            NativeMidi_FreeMIDIEventList(song->evtlist);
+            song->evtlist = NULL;
+        }
+    }
 
-    SDL_SetAtomicInt(&song->playerstate, NATIVE_MIDI_STOPPED);
+    if (!song->evtlist && !song->stream) {
+        free_song_controls(song);
+        NativeMidi_free(song);
+        SDL_SetError("Failed to create MIDIEventList");
+        return NULL;
+    }
 
+    if (!acquire_seq()) {
+        free_song_events(song);
+        free_song_controls(song);
+        NativeMidi_free(song);
+        return NULL;
+    }
+    song->seq = shared_seq;
+    song->srcport = shared_port;
+    /* Send events to all subscribers, wherever our port is connected to */
+    song->dstaddr.client = SND_SEQ_ADDRESS_SUBSCRIBERS;
+    song->dstaddr.port = SND_SEQ_ADDRESS_UNKNOWN;
+
+    size_seq_buffers(song);
+
+    /* Since ALSA requires the starting F0 for SysEx, but the extra data doesn't contain it, */
+    /* SysEx messages have to be put together somewhere. Decoded songs are lowered to ALSA */
+    /* events now, which does that as well; streams are put together by the player thread */
+    if (song->evtlist && !lower_song_events(song)) {
+        release_seq();
+        free_song_events(song);
+        free_song_controls(song);
+        NativeMidi_free(song);
+        return NULL;
+    }
+
+    SDL_SetAtomicInt(&song->playerstate, NATIVE_MIDI_STOPPED);
+    SDL_SetAtomicInt(&song->seektick, -1);
 
     /* Since there's no reliable volume control solution it's better to leave the music playing instead of having hanging notes */
     song->allow_pause = SDL_GetHintBoolean("SDL_NATIVE_MIDI_ALLOW_PAUSE", false);
 
+    /* Keeping only a little of the song queued ahead needs the time map to know how much */
+    /* that is; get streams scanned now rather than on the player thread */
+    song->lookahead = (Uint32)SDL_min(get_size_hint("SDL_NATIVE_MIDI_ALSA_LOOKAHEAD"), 60000);
+    if (song->lookahead && !NativeMidi_GetSongTimeMap(song)) {
+        song->lookahead = 0;
+    }
+
     if (closeio) {
         SDL_CloseIO(src);
     }
 
-    currentsong = song;
     return song;
 }
 
+/* Tell the player thread of a song to quit, if it's running, and wait for it. */
+/* The caller holds song->lock */
+static void stop_player(NativeMidi_Song *song)
+{
+    if (song->playerthread) {
+        /* Don't send any messages to the player thread if it's out of the main loop */
+        if (SDL_GetAtomicInt(&song->playerstate) > NATIVE_MIDI_STOPPED) {
+            send_cmd(song, THREAD_CMD_QUIT);
+        }
+        SDL_WaitThread(song->playerthread, NULL);
+        song->playerthread = NULL;
+    }
+}
+
 void NativeMidi_DestroySong(NativeMidi_Song *song)
 {
     if (song) {
-        close_seq(song->seq, song->srcport);
-        NativeMidi_FreeMIDIEventList(song->evtlist);
-        close_sockpair(song);
-        SDL_free(song);
+        /* Make sure none of the global controls is still working on the song */
+        SDL_LockSpinlock(&currentsong_lock);
+        if (currentsong == song) {
+            currentsong = NULL;
+        }
+        SDL_UnlockSpinlock(&currentsong_lock);
+        while (SDL_GetAtomicInt(&song->users) > 0) {
+            SDL_Delay(1);
+        }
+
+        /* The player thread uses the shared client, which may go away with the song */
+        SDL_LockMutex(song->lock);
+        stop_player(song);
+        SDL_UnlockMutex(song->lock);
+        release_seq();
+        free_song_events(song);
+        free_song_controls(song);
+        NativeMidi_free(song);
     }
 }
 
-/* Schedule an echo event right after the last event to know when playback is finished */
-static SDL_INLINE void enqueue_echo_event(const NativeMidi_Song *song, const int queue)
+bool NativeMidi_GetSongStats(NativeMidi_Song *song, NativeMidi_SongStats *stats)
 {
-    snd_seq_event_t evt;
-    snd_seq_ev_clear(&evt);
-    evt.type = SND_SEQ_EVENT_ECHO;
-    snd_seq_ev_set_source(&evt, song->srcport);
-    snd_seq_ev_set_dest(&evt, ALSA_snd_seq_client_id(song->seq), song->srcport);
-    snd_seq_ev_schedule_tick(&evt, queue, 0, song->endtime + 1);
-    while (ALSA_snd_seq_event_output(song->seq, &evt) == -EAGAIN) { /* spin */ }
+    if (!song) {
+        return SDL_InvalidParamError("song");
+    } else if (!stats) {
+        return SDL_InvalidParamError("stats");
+    }
+
+    SDL_zerop(stats);
+    stats->allocations = 1;
+    stats->resident_bytes = sizeof(NativeMidi_Song);
+    stats->output_stalls = (Uint32)SDL_GetAtomicInt(&song->stalls);
+    if (song->lowered) {
+        stats->allocations++;
+        stats->resident_bytes += song->lowered->size;
+        SDL_LockSpinlock(&lowered_lock);
+        if (song->lowered->refcount > 1) {
+            stats->shared = true;
+        }
+        SDL_UnlockSpinlock(&lowered_lock);
+    }
+    if (song->sysexbuf) {
+        stats->allocations++;
+        stats->resident_bytes += song->sysexbuflen;
+    }
+    if (song->evtlist) {
+        NativeMidi_AddMIDIEventListStats(song->evtlist, stats);
+    } else {
+        NativeMidi_AddMIDIEventStreamStats(song->stream, stats);
+    }
+    return true;
+}
+
+const MIDITimeMap *NativeMidi_GetSongTimeMap(NativeMidi_Song *song)
+{
+    if (song->evtlist) {
+        return &song->evtlist->time;
+    }
+    return NativeMidi_GetMIDIEventStreamTimeMap(song->stream);
+}
+
+/* Throw away the events a song still has queued. Its events are tagged with its */
+/* queue, which keeps the other songs on the client out of this */
+static void drop_queue_output(const NativeMidi_Song *song, const int queue)
+{
+    snd_seq_remove_events_t *remove;
+    snd_seq_remove_events_alloca(&remove);
+    ALSA_snd_seq_remove_events_set_condition(remove, SND_SEQ_REMOVE_OUTPUT | SND_SEQ_REMOVE_TAG_MATCH);
+    ALSA_snd_seq_remove_events_set_tag(remove, queue);
+    ALSA_snd_seq_remove_events(song->seq, remove);
+}
 
+/* Queue an event. A SysEx message that doesn't fit into the output buffer (which */
+/* can't grow while other songs are playing) goes to the kernel directly, once */
+/* everything before it has. This returns -EAGAIN if the sequencer is full */
+static int output_event(const NativeMidi_Song *song, snd_seq_event_t *evt)
+{
+    int rc = ALSA_snd_seq_event_output(song->seq, evt);
+
+    if (rc == -EINVAL && evt->type == SND_SEQ_EVENT_SYSEX) {
+        rc = ALSA_snd_seq_drain_output(song->seq);
+        if (rc > 0) {
+            rc = -EAGAIN;
+        } else if (rc == 0) {
+            rc = ALSA_snd_seq_event_output_direct(song->seq, evt);
+        }
+    }
+    return (rc < 0) ? rc : 0;
+}
+
+/* Queue an event, waiting for room if the sequencer is full */
+static void output_event_wait(NativeMidi_Song *song, snd_seq_event_t *evt)
+{
+    struct pollfd pfd;
+
+    while (ALSA_snd_seq_event_output(song->seq, evt) == -EAGAIN) {
+        SDL_AddAtomicInt(&song->stalls, 1);
+        if (ALSA_snd_seq_poll_descriptors(song->seq, &pfd, 1, POLLOUT) == 1) {
+            poll(&pfd, 1, POSITION_UPDATE_MS);
+        }
+    }
 }
 
 /* Reset the queue position to 0 */
-static SDL_INLINE void enqueue_queue_reset_event(const NativeMidi_Song *song, const int queue)
+static SDL_INLINE void enqueue_queue_reset_event(NativeMidi_Song *song, const int queue)
 {
     snd_seq_event_t evt;
     snd_seq_ev_clear(&evt);
     snd_seq_ev_set_source(&evt, song->srcport);
     snd_seq_ev_set_queue_pos_tick(&evt, queue, 0);
     /* Schedule it to some point in the past, so that it is guaranteed */
-    /* to run immediately and before the echo */
+    /* to run immediately and before the song starts over */
     snd_seq_ev_schedule_tick(&evt, queue, 0, 0);
-    while (ALSA_snd_seq_event_output(song->seq, &evt) == -EAGAIN) { /* spin */ }
+    output_event_wait(song, &evt);
 }
 
 /* Sysex to set the volume */
@@ -590,30 +1359,219 @@ static SDL_INLINE void continue_queue(const NativeMidi_Song *song, const int que
     ALSA_snd_seq_event_output_direct(song->seq, &evt);
 }
 
-/* Playback thread */
-static int NativeMidi_player_thread(void *d)
+/* Publish a position for NativeMidi_GetPosition */
+static void store_position(NativeMidi_Song *song, const Uint32 tick, const Uint64 stamp)
 {
-    unsigned char current_volume = 0x7F;
-    bool playback_finished = false;
-    NativeMidi_Song *song = d;
-    MIDIEvent *event = song->evtlist;
+    SDL_AddAtomicInt(&song->posseq, 1);
+    SDL_MemoryBarrierRelease();
+    song->postick = tick;
+    song->posstamp = stamp;
+    SDL_MemoryBarrierRelease();
+    SDL_AddAtomicInt(&song->posseq, 1);
+}
+
+/* Where a queue tick is in the song, whichever time around it belongs to */
+static SDL_INLINE Uint32 song_tick(const NativeMidi_Song *song, const Uint32 tick)
+{
+    if (tick >= song->loopstart) {
+        return tick - song->loopstart;
+    } else if (tick >= song->prevloopstart) {
+        return tick - song->prevloopstart;
+    }
+    return tick;
+}
+
+/* Ask the sequencer where the queue is and publish that */
+static void update_position(NativeMidi_Song *song, const int queue, snd_seq_queue_status_t *status, const bool moving)
+{
+    if (ALSA_snd_seq_get_queue_status(song->seq, queue, status) == 0) {
+        store_position(song, song_tick(song, ALSA_snd_seq_queue_status_get_tick_time(status)), moving ? SDL_GetTicksNS() : 0);
+    }
+}
+
+static void load_position(NativeMidi_Song *song, Uint32 *tick, Uint64 *stamp)
+{
+    int seq;
+    do {
+        seq = SDL_GetAtomicInt(&song->posseq);
+        SDL_MemoryBarrierAcquire();
+        *tick = song->postick;
+        *stamp = song->posstamp;
+        SDL_MemoryBarrierAcquire();
+    } while ((seq & 1) || seq != SDL_GetAtomicInt(&song->posseq));
+}
+
+/* Silence every channel and put its controllers back to their defaults */
+static void reset_channels(const NativeMidi_Song *song)
+{
+    snd_seq_event_t evt;
     int i;
-    int queue = ALSA_snd_seq_alloc_named_queue(song->seq, "SDL_Mixer Playback");
-    snd_seq_start_queue(song->seq, queue, NULL);
 
-    /* Prepare main sequencer event */
+    snd_seq_ev_clear(&evt);
+    snd_seq_ev_set_source(&evt, song->srcport);
+    snd_seq_ev_set_dest(&evt, song->dstaddr.client, song->dstaddr.port);
+    snd_seq_ev_set_direct(&evt);
+
+    /* Some of these are bound to work */
+    for (i = 0; i < MIDI_CHANNELS; i++) {
+        snd_seq_ev_set_controller(&evt, i, MIDI_CTL_SUSTAIN, 0);
+        ALSA_snd_seq_event_output_direct(song->seq, &evt);
+        snd_seq_ev_set_controller(&evt, i, MIDI_CTL_ALL_NOTES_OFF, 0);
+        ALSA_snd_seq_event_output_direct(song->seq, &evt);
+        snd_seq_ev_set_controller(&evt, i, MIDI_CTL_RESET_CONTROLLERS, 0);
+        ALSA_snd_seq_event_output_direct(song->seq, &evt);
+        snd_seq_ev_set_controller(&evt, i, MIDI_CTL_ALL_SOUNDS_OFF, 0);
+        ALSA_snd_seq_event_output_direct(song->seq, &evt);
+    }
+}
+
+/* Set every channel up the way the song has it at some point */
+static void send_chase_state(const NativeMidi_Song *song, const MIDIChaseState *state)
+{
     snd_seq_event_t evt;
+    int i, c;
+
     snd_seq_ev_clear(&evt);
     snd_seq_ev_set_source(&evt, song->srcport);
     snd_seq_ev_set_dest(&evt, song->dstaddr.client, song->dstaddr.port);
+    snd_seq_ev_set_direct(&evt);
+
+    for (i = 0; i < MIDI_CHANNELS; i++) {
+        const MIDIChannelState *channel = &state->channel[i];
+
+        /* Controllers go first, as bank selects only take effect with the next program change */
+        for (c = 0; c < (int)SDL_arraysize(channel->controller); c++) {
+            if (channel->controller[c] != MIDI_CHASE_UNSET) {
+                snd_seq_ev_set_controller(&evt, i, c, channel->controller[c]);
+                ALSA_snd_seq_event_output_direct(song->seq, &evt);
+            }
+        }
+        if (channel->program != MIDI_CHASE_UNSET) {
+            snd_seq_ev_set_pgmchange(&evt, i, channel->program);
+            ALSA_snd_seq_event_output_direct(song->seq, &evt);
+        }
+        if (channel->bend[1] != MIDI_CHASE_UNSET) {
+            snd_seq_ev_set_pitchbend(&evt, i, ((((int)channel->bend[1]) << 7) | channel->bend[0]) - 8192);
+            ALSA_snd_seq_event_output_direct(song->seq, &evt);
+        }
+    }
+}
+
+/* The event at pos and its extra data, from the list or the stream; NULL at the end of the song */
+static SDL_INLINE const MIDIEvent *get_event(const NativeMidi_Song *song, const Uint32 pos, const Uint8 **extra)
+{
+    const MIDIEvent *event;
+
+    if (song->stream) {
+        return NativeMidi_PeekMIDIEventStream(song->stream, extra);
+    }
+    if (pos == song->evtlist->nEvents) {
+        return NULL;
+    }
+    event = &song->evtlist->events[pos];
+    *extra = NativeMidi_GetExtraData(song->evtlist, event);
+    return event;
+}
+
+static SDL_INLINE void next_event(const NativeMidi_Song *song, Uint32 *pos)
+{
+    if (song->stream) {
+        NativeMidi_AdvanceMIDIEventStream(song->stream);
+    } else {
+        (*pos)++;
+    }
+}
+
+static SDL_INLINE void rewind_events(const NativeMidi_Song *song, Uint32 *pos)
+{
+    if (song->stream) {
+        NativeMidi_RewindMIDIEventStream(song->stream);
+    }
+    *pos = 0;
+}
+
+/* Jump to tick: throw away what's queued, move the queue there and set the */
+/* channels up the way the song has them at that point */
+static void seek_events(NativeMidi_Song *song, const int queue, snd_seq_queue_tempo_t *tempo, const Uint32 tick, Uint32 *pos)
+{
+    MIDIChaseState state;
+    snd_seq_event_t evt;
+
+    drop_queue_output(song, queue);
+    reset_channels(song);
+
+    if (song->stream) {
+        NativeMidi_SeekMIDIEventStream(song->stream, tick, &state);
+        *pos = 0;
+    } else {
+        *pos = NativeMidi_SeekMIDIEventList(song->evtlist, tick, &state);
+    }
+
+    ALSA_snd_seq_queue_tempo_set_tempo(tempo, state.tempo ? state.tempo : 500000);
+    ALSA_snd_seq_set_queue_tempo(song->seq, queue, tempo);
+
+    snd_seq_ev_clear(&evt);
+    snd_seq_ev_set_source(&evt, song->srcport);
+    snd_seq_ev_set_queue_pos_tick(&evt, queue, tick);
+    snd_seq_ev_set_direct(&evt);
+    ALSA_snd_seq_event_output_direct(song->seq, &evt);
+    song->loopstart = song->prevloopstart = 0;
+
+    send_chase_state(song, &state);
+}
+
+/* How long to wait for the queue to get past the last event of a song, given */
+/* where it is now, as a poll timeout */
+static int end_of_song_timeout(NativeMidi_Song *song, const Uint32 now, const Uint32 endtime)
+{
+    const MIDITimeMap *map;
+    Uint64 from, to;
+
+    if (now > endtime || !(map = NativeMidi_GetSongTimeMap(song))) {
+        return 1;
+    }
+    from = NativeMidi_MapTicksToMicroseconds(map, now);
+    to = NativeMidi_MapTicksToMicroseconds(map, endtime + 1);
+    return (int)SDL_clamp((to - from) / 1000 + 1, 1, POSITION_UPDATE_MS);
+}
+
+/* Playback thread. Other songs may be playing on the shared client at the same */
+/* time, so this holds seq_mutex for everything but waiting in poll */
+static int NativeMidi_player_thread(void *d)
+{
+    unsigned char current_volume = 0x7F;
+    bool quit = false;
+    NativeMidi_Song *song = d;
+    const MIDIEvent *event;
+    const Uint8 *extra = NULL;
+    Uint32 pos = 0;
+    Uint32 endtime = 0;
+    Sint64 limit = SDL_MAX_SINT64;
+    Uint64 lastupdate;
+    int endwait = -1;
+    int seektick;
+    int queue;
+    int rc;
+
+    SDL_LockMutex(seq_mutex);
+    queue = ALSA_snd_seq_alloc_named_queue(song->seq, "SDL_Mixer Playback");
+    if (queue < 0) {
+        SDL_UnlockMutex(seq_mutex);
+        SDL_SetAtomicInt(&song->playerstate, NATIVE_MIDI_STOPPED);
+        return 0;
+    }
+    apply_seq_sizes(song->seq);
+    seq_queues++;
+    snd_seq_start_queue(song->seq, queue, NULL);
+
+    snd_seq_event_t evt;
 
-    /* Set up nonblock functionality */
+    /* Set up nonblock functionality; the client is always nonblocking */
     struct pollfd pfds[2] = { {
-        .fd = song->threadsock,
+        .fd = song->cmdfd,
         .events = POLLIN,
     } };
-    ALSA_snd_seq_poll_descriptors(song->seq, pfds + 1, 1, POLLIN | POLLOUT);
-    ALSA_snd_seq_nonblock(song->seq, 1);
+    ALSA_snd_seq_poll_descriptors(song->seq, pfds + 1, 1, POLLOUT);
 
     /* Set initial queue tempo and ppqn */
     snd_seq_queue_tempo_t *tempo;
@@ -622,185 +1580,256 @@ static int NativeMidi_player_thread(void *d)
     ALSA_snd_seq_queue_tempo_set_ppq(tempo, song->ppqn);
     ALSA_snd_seq_set_queue_tempo(song->seq, queue, tempo);
 
-    /* We use this to know when the track has finished playing */
-    enqueue_echo_event(song, queue);
+    snd_seq_queue_status_t *status;
+    snd_seq_queue_status_alloca(&status);
+
+    rewind_events(song, &pos);
+    song->loopstart = song->prevloopstart = 0;
 
+    /* The song may have been told where to start */
+    seektick = SDL_SetAtomicInt(&song->seektick, -1);
+    if (seektick >= 0) {
+        seek_events(song, queue, tempo, (Uint32)seektick, &pos);
+        endtime = (Uint32)seektick;
+    }
+
+    update_position(song, queue, status, true);
+    lastupdate = SDL_GetTicksNS();
     SDL_SetAtomicInt(&song->playerstate, NATIVE_MIDI_PLAYING);
 
     while (1) {
-        unsigned char readbuf[CMD_PKT_LEN];
-        MIDIDbgLog("Poll...");
-        if (poll(pfds, 2, -1) <= 0) {
+        native_midi_thread_cmd cmd;
+        Uint64 wakeups;
+        /* With a lookahead window, wake up often enough to keep it topped up */
+        int timeout = song->lookahead ? SDL_clamp(song->lookahead / 2, 1, POSITION_UPDATE_MS) : POSITION_UPDATE_MS;
+        if (endwait >= 0) {
+            timeout = SDL_min(timeout, endwait);
+        }
+
+        SDL_UnlockMutex(seq_mutex);
+        rc = poll(pfds, 2, timeout);
+        SDL_LockMutex(seq_mutex);
+        if (rc < 0) {
             break;
         }
-        MIDIDbgLog("revents: cmdsock %hd, ALSA %hd", pfds[0].revents, pfds[1].revents);
 
-        /* Do we have a command from the main thread? */
+        /* Readers carry the position on from here by the clock, so this */
+        /* only has to keep them from drifting. Once in a while is also often */
+        /* enough to follow ports coming and going while the song plays */
+        if (SDL_GetTicksNS() - lastupdate >= SDL_MS_TO_NS(POSITION_UPDATE_MS)) {
+            update_position(song, queue, status, SDL_GetAtomicInt(&song->playerstate) == NATIVE_MIDI_PLAYING);
+            refresh_destinations(song->seq, song->srcport);
+            lastupdate = SDL_GetTicksNS();
+        }
+        if (rc == 0 && !song->lookahead && endwait < 0) {
+            continue;
+        }
+        endwait = -1;
+
+        /* Do we have commands from other threads? Take the wakeup first, so that */
+        /* commands added while we go through the ring wake us up again */
         if (pfds[0].revents & POLLIN) {
-            /* This will process exactly one command by design because all packets are fixed size (CMD_PKT_LEN) */
-            if (read(song->threadsock, readbuf, sizeof(readbuf)) == sizeof(readbuf)) {
-                MIDIDbgLog("Got control %hhx", readbuf[0]);
-                switch ((native_midi_thread_cmd)readbuf[0]) {
+            (void)!read(song->cmdfd, &wakeups, sizeof(wakeups));
+            SDL_SetAtomicInt(&song->cmdwakeup, 0);
+
+            while (!quit && pop_cmd(song, &cmd)) {
+                MIDIDbgLog("Got control %hhx", (Uint8)cmd);
+                switch (cmd) {
 
                 case THREAD_CMD_QUIT:
-                    event = NULL;
-                    song->loopcount = 0;
-                    playback_finished = true;
+                    quit = true;
                     break;
 
                 case THREAD_CMD_SETVOL:
-                    current_volume = readbuf[1];
+                    /* Changes made from here on take another command */
+                    SDL_SetAtomicInt(&song->volpending, 0);
+                    current_volume = (unsigned char)SDL_GetAtomicInt(&song->volume);
                     send_volume_sysex(song, current_volume);
                     break;
 
                 case THREAD_CMD_PAUSE:
                     send_volume_sysex(song, 0);
                     stop_queue(song, queue);
+                    update_position(song, queue, status, false);
                     SDL_SetAtomicInt(&song->playerstate, NATIVE_MIDI_PAUSED);
                     break;
 
                 case THREAD_CMD_RESUME:
                     continue_queue(song, queue);
                     send_volume_sysex(song, current_volume);
+                    update_position(song, queue, status, true);
                     SDL_SetAtomicInt(&song->playerstate, NATIVE_MIDI_PLAYING);
                     break;
+
+                case THREAD_CMD_SEEK:
+                    /* Several seeks in a row only need to go to the last place */
+                    seektick = SDL_SetAtomicInt(&song->seektick, -1);
+                    if (seektick >= 0) {
+                        seek_events(song, queue, tempo, (Uint32)seektick, &pos);
+                        send_volume_sysex(song, current_volume);
+                        update_position(song, queue, status, SDL_GetAtomicInt(&song->playerstate) == NATIVE_MIDI_PLAYING);
+                        endtime = (Uint32)seektick;
+                        pfds[1].events |= POLLOUT;
+                    }
+                    break;
                 }
             }
         }
 
-        /* Can we read from the sequencer? */
-        if (pfds[1].revents & POLLIN) {
-            snd_seq_event_t *revt;
-            /* Make sure we read an echo event, and that it came from us */
-            if (ALSA_snd_seq_event_input(song->seq, &revt) >= 0 && revt->type == SND_SEQ_EVENT_ECHO && revt->source.client == ALSA_snd_seq_client_id(song->seq) && revt->source.port == song->srcport) {
-                playback_finished = true;
-            }
+        if (quit) {
+            break;
         }
 
-        /* Have we reached the end of the event list? */
+        /* Have we reached the end of the song? */
+        event = get_event(song, pos, &extra);
         if (!event) {
-            /* If we have, are we done playing? */
-            if (playback_finished) {
+            const bool drained = (ALSA_snd_seq_drain_output(song->seq) == 0);
+            const bool havestatus = (ALSA_snd_seq_get_queue_status(song->seq, queue, status) == 0);
+            const Uint32 tick = havestatus ? ALSA_snd_seq_queue_status_get_tick_time(status) : 0;
+            /* The next time around starts right after the last event of this one. Ticks */
+            /* would run out after weeks of looping, so before they do, start over from 0 */
+            const bool gapless = ((Uint64)song->loopstart + endtime + 1 <= SDL_MAX_SINT32);
+
+            if (song->loopcount != 0 && gapless) {
+                /* Queue the next time around once this one is playing, so there are */
+                /* never more than two of them in the queue */
+                if (!havestatus || tick < song->loopstart) {
+                    if (drained) {
+                        pfds[1].events &= ~POLLOUT;
+                        endwait = havestatus ? end_of_song_timeout(song, song_tick(song, tick), song->loopstart - song->prevloopstart - 1) : POSITION_UPDATE_MS;
+                    }
+                    continue;
+                }
+
+                MIDIDbgLog("Playback is looping");
+
+                rewind_events(song, &pos);
+                event = get_event(song, pos, &extra);
+                song->prevloopstart = song->loopstart;
+                song->loopstart += endtime + 1;
+                endtime = 0;
+
+                if (song->loopcount > 0) {
+                    song->loopcount--;
+                }
+
+                /* Allow ready to write events again */
+                pfds[1].events |= POLLOUT;
+            } else if (drained && havestatus && tick > song->loopstart + endtime &&
+                       ALSA_snd_seq_queue_status_get_events(status) == 0) {
+                /* Otherwise, we're done once everything is handed over, and the */
+                /* queue is past the last event with nothing left in it */
                 if (song->loopcount == 0) {
                     break;
                 }
 
-                MIDIDbgLog("Playback is looping");
+                MIDIDbgLog("Playback is looping from tick 0");
 
-                /* If we need to loop, roll back the list head and keep going */
-                event = song->evtlist;
+                /* If we need to loop, roll back to the first event and keep going */
+                rewind_events(song, &pos);
+                event = get_event(song, pos, &extra);
 
-                /* We need to reset the queue, otherwise the ticks will be wrong */
+                /* We need to reset the queue, otherwise the ticks will be wrong. Send that */
+                /* off now, so the lookahead window starts over from the new position */
                 enqueue_queue_reset_event(song, queue);
-                enqueue_echo_event(song, queue);
+                ALSA_snd_seq_drain_output(song->seq);
+                song->loopstart = song->prevloopstart = 0;
+                endtime = 0;
 
                 if (song->loopcount > 0) {
                     song->loopcount--;
                 }
 
-                playback_finished = false;
-
                 /* Allow ready to write events again */
                 pfds[1].events |= POLLOUT;
             } else {
-                /* If not, keep draining, otherwise we'll never reach the echo event */
-                /* When we finish though, prevent any "ready to write to alsa" polls */
-                MIDIDbgLog("Draining output!");
-                if (ALSA_snd_seq_drain_output(song->seq) == 0) {
+                /* If not, keep draining while there's anything left to hand over. Once */
+                /* there isn't, stop polling for room, and wait for the queue to get there */
+                if (drained) {
                     pfds[1].events &= ~POLLOUT;
+                    endwait = havestatus ? end_of_song_timeout(song, tick >= song->loopstart ? tick - song->loopstart : 0, endtime) : POSITION_UPDATE_MS;
                 }
                 continue;
             }
         }
 
-        /* Don't proceed if we can't write to the sequencer */
-        if (!(pfds[1].revents & POLLOUT)) {
+        /* Don't proceed if we can't write to the sequencer. A lookahead window is topped */
+        /* up every time around, and only waits on the sequencer when it's full */
+        if (song->lookahead) {
+            const MIDITimeMap *map = NativeMidi_GetSongTimeMap(song);
+            const Uint64 window = (Uint64)song->lookahead * 1000;
+            Uint32 now = song->loopstart + endtime;
+
+            if (ALSA_snd_seq_get_queue_status(song->seq, queue, status) == 0) {
+                now = ALSA_snd_seq_queue_status_get_tick_time(status);
+            }
+            if (now >= song->loopstart) {
+                limit = NativeMidi_MapMicrosecondsToTicks(map, NativeMidi_MapTicksToMicroseconds(map, now - song->loopstart) + window);
+            } else {
+                /* The time around before is still playing; the window reaches */
+                /* into this one by whatever is left over past its end */
+                const Uint64 left = NativeMidi_MapTicksToMicroseconds(map, song->loopstart - song->prevloopstart) -
+                                    NativeMidi_MapTicksToMicroseconds(map, now - song->prevloopstart);
+                limit = (window > left) ? (Sint64)NativeMidi_MapMicrosecondsToTicks(map, window - left) : -1;
+            }
+        } else if (!(pfds[1].revents & POLLOUT)) {
             continue;
         }
 
-        /* Finally, if we get here, we process MIDI events and send them to the sequencer */
-        const unsigned char cmd = event->status & 0xF0;
-        const unsigned char channel = event->status & 0x0F;
-
-        snd_seq_ev_set_dest(&evt, song->dstaddr.client, song->dstaddr.port);
-        snd_seq_ev_set_fixed(&evt);
-        snd_seq_ev_schedule_tick(&evt, queue, 0, event->time);
-
-        bool unhandled = false;
-
-        switch (cmd) {
-
-        case MIDI_CMD_NOTE_ON:
-            snd_seq_ev_set_noteon(&evt, channel, event->data[0], event->data[1]);
-            break;
-
-        case MIDI_CMD_NOTE_OFF:
-            snd_seq_ev_set_noteoff(&evt, channel, event->data[0], event->data[1]);
-            break;
-
-        case MIDI_CMD_CONTROL:
-            snd_seq_ev_set_controller(&evt, channel, event->data[0], event->data[1]);
-            break;
-
-        case MIDI_CMD_NOTE_PRESSURE:
-            snd_seq_ev_set_keypress(&evt, channel, event->data[0], event->data[1]);
-            break;
-
-        case MIDI_CMD_PGM_CHANGE:
-            snd_seq_ev_set_pgmchange(&evt, channel, event->data[0]);
-            break;
+        /* Finally, if we get here, we send MIDI events to the sequencer. Fill the output */
+        /* buffer with as many as the sequencer takes in one go (or as the lookahead window */
+        /* allows); once it's full, poll tells us when there's room again */
+        while ((event = get_event(song, pos, &extra))) {
+            if ((Sint64)event->time > limit) {
+                pfds[1].events &= ~POLLOUT;
+                break;
+            }
+            if (song->lowered) {
+                evt = song->lowered->events[pos];
+                evt.source.port = (unsigned char)song->srcport;
+                evt.queue = queue;
+                evt.tag = queue;
+                if (evt.type == SND_SEQ_EVENT_TEMPO) {
+                    evt.data.queue.queue = queue;
+                } else {
+                    evt.dest = song->dstaddr;
+                }
+            } else if (event->status == MIDI_CMD_COMMON_SYSEX && !reserve_sysexbuf(song, event->extraLen)) {
+                evt.type = SND_SEQ_EVENT_NONE;
+            } else {
+                lower_event(song, &evt, queue, event, extra, song->sysexbuf);
+            }
+            evt.time.tick += song->loopstart;
 
-        case MIDI_CMD_BENDER:
-            snd_seq_ev_set_pitchbend(&evt, channel, ((((int)event->data[1]) << 7) | (event->data[0] & 0x7F)) - 8192);
-            break;
+            const bool unhandled = (evt.type == SND_SEQ_EVENT_NONE);
+            const int sent = unhandled ? 0 : output_event(song, &evt);
 
-        default:
-            if (event->status == MIDI_SMF_META_EVENT) {
-                if (event->data[0] == MIDI_SMF_META_TEMPO && event->extraLen == 3) {
-                    unsigned int t = ((unsigned)event->extraData[0] << 16) |
-                                     ((unsigned)event->extraData[1] << 8) |
-                                     event->extraData[2];
-
-                    /* This changes the event destination, so we have to restore it in the next iteration */
-                    snd_seq_ev_set_queue_tempo(&evt, queue, t);
-                    break;
-                }
-            } else if (event->status == MIDI_CMD_COMMON_SYSEX) {
-                snd_seq_ev_set_sysex(&evt, event->extraLen, event->extraData);
+            if (sent == -EAGAIN) {
+                SDL_AddAtomicInt(&song->stalls, 1);
+                pfds[1].events |= POLLOUT;
                 break;
+            } else if (sent < 0) {
+                MIDIDbgLog("Couldn't queue an event: %d", sent);
             }
-
-            unhandled = true;
+            endtime = event->time;
+            next_event(song, &pos);
         }
 
-        if (unhandled || ALSA_snd_seq_event_output(song->seq, &evt) != -EAGAIN) {
-            MIDIDbgLog("%s %" SDL_PRIu32 ": %hhx %hhx %hhx (extraLen %" SDL_PRIu32 ")", (unhandled ? "Unhandled" : "Event"), event->time, event->status, event->data[0], event->data[1], event->extraLen);
-            event = event->next;
-        }
+        /* Hand over whatever is still buffered; if the sequencer is full, the rest */
+        /* goes out the next time around */
+        ALSA_snd_seq_drain_output(song->seq);
     }
 
     SDL_SetAtomicInt(&song->playerstate, NATIVE_MIDI_STOPPED);
 
-    /* Switch back to blocking mode and drop everything */
-    ALSA_snd_seq_nonblock(song->seq, 0);
-    ALSA_snd_seq_drop_output(song->seq);
-    snd_seq_stop_queue(song->seq, queue, NULL);
-    ALSA_snd_seq_drain_output(song->seq);
+    /* Drop whatever is left of the song; the queue goes away with everything in it */
+    drop_queue_output(song, queue);
     ALSA_snd_seq_free_queue(song->seq, queue);
+    seq_queues--;
 
     /* Stop all audio */
-    /* Some of these are bound to work */
-    snd_seq_ev_set_direct(&evt);
-    for (i = 0; i < MIDI_CHANNELS; i++) {
-        snd_seq_ev_set_controller(&evt, i, MIDI_CTL_SUSTAIN, 0);
-        ALSA_snd_seq_event_output_direct(song->seq, &evt);
-        snd_seq_ev_set_controller(&evt, i, MIDI_CTL_ALL_NOTES_OFF, 0);
-        ALSA_snd_seq_event_output_direct(song->seq, &evt);
-        snd_seq_ev_set_controller(&evt, i, MIDI_CTL_RESET_CONTROLLERS, 0);
-        ALSA_snd_seq_event_output_direct(song->seq, &evt);
-        snd_seq_ev_set_controller(&evt, i, MIDI_CTL_ALL_SOUNDS_OFF, 0);
-        ALSA_snd_seq_event_output_direct(song->seq, &evt);
-    }
+    reset_channels(song);
+    SDL_UnlockMutex(seq_mutex);
 
     MIDIDbgLog("Playback thread returns");
     return 0;
@@ -808,71 +1837,218 @@ static int NativeMidi_player_thread(void *d)
 
 void NativeMidi_Start(NativeMidi_Song *song, int loops)
 {
+    native_midi_thread_cmd cmd;
+
     if (song) {
-        if (song->playerthread) {
-            if (SDL_GetAtomicInt(&currentsong->playerstate) > NATIVE_MIDI_STOPPED) {
-                if (write(song->mainsock, pkt_thread_cmd_quit, CMD_PKT_LEN) != sizeof(pkt_thread_cmd_quit)) {
-                    return;
-                }
-            }
-            SDL_WaitThread(song->playerthread, NULL);
+        SDL_LockMutex(song->lock);
+        stop_player(song);
+
+        /* Whatever the last player thread didn't get to is meant for it, not the next */
+        while (pop_cmd(song, &cmd)) {
         }
+        SDL_SetAtomicInt(&song->volpending, 0);
+
+        /* Play wherever is best right now, in case ports came or went since */
+        SDL_LockMutex(seq_mutex);
+        refresh_destinations(song->seq, song->srcport);
+        SDL_UnlockMutex(seq_mutex);
 
         song->loopcount = loops;
 
+        /* Until the player thread knows better, the song is at its start */
+        store_position(song, 0, 0);
+
         /* If this isn't set here, then the application might think we finished before playback even started */
         SDL_SetAtomicInt(&song->playerstate, NATIVE_MIDI_STARTING);
 
         song->playerthread = SDL_CreateThread(NativeMidi_player_thread, "SDL_MIDI", song);
+        if (!song->playerthread) {
+            SDL_SetAtomicInt(&song->playerstate, NATIVE_MIDI_STOPPED);
+        }
+        SDL_UnlockMutex(song->lock);
+
+        SDL_LockSpinlock(&currentsong_lock);
+        currentsong = song;
+        SDL_UnlockSpinlock(&currentsong_lock);
     }
 }
 
+bool NativeMidi_Seek(NativeMidi_Song *song, Uint64 ms)
+{
+    const MIDITimeMap *map;
+    Uint32 tick;
+
+    if (!song) {
+        return SDL_InvalidParamError("song");
+    } else if (!(map = NativeMidi_GetSongTimeMap(song))) {
+        return false;
+    }
+
+    tick = NativeMidi_MapMicrosecondsToTicks(map, SDL_min(ms, SDL_MAX_UINT64 / 1000) * 1000);
+    /* A playing song jumps right away; otherwise, this is where the next start begins. */
+    /* If an earlier seek is still on its way, the player goes straight here instead */
+    if (SDL_SetAtomicInt(&song->seektick, (int)SDL_min(tick, SDL_MAX_SINT32)) < 0 &&
+        SDL_GetAtomicInt(&song->playerstate) > NATIVE_MIDI_STOPPED) {
+        send_cmd(song, THREAD_CMD_SEEK);
+    }
+    return true;
+}
+
 /* The following functions require song to be global (thus currentsong is used) */
 void NativeMidi_Pause(void)
 {
-    NativeMidi_Song *song = currentsong;
+    NativeMidi_Song *song = get_current_song();
     if (song && SDL_GetAtomicInt(&song->playerstate) != NATIVE_MIDI_STOPPED && song->allow_pause) {
-        (void)!write(song->mainsock, pkt_thread_cmd_pause, CMD_PKT_LEN);
+        send_cmd(song, THREAD_CMD_PAUSE);
     }
+    put_current_song(song);
 }
 
 void NativeMidi_Resume(void)
 {
-    NativeMidi_Song *song = currentsong;
+    NativeMidi_Song *song = get_current_song();
     if (song && SDL_GetAtomicInt(&song->playerstate) == NATIVE_MIDI_PAUSED && song->allow_pause) {
-        (void)!write(song->mainsock, pkt_thread_cmd_resume, CMD_PKT_LEN);
+        send_cmd(song, THREAD_CMD_RESUME);
     }
+    put_current_song(song);
 }
 
 void NativeMidi_Stop(void)
 {
-    NativeMidi_Song *song = currentsong;
-    if (song && song->playerthread) {
-        /* Don't send any messages to the main thread if it's out of the main loop */
-        if (SDL_GetAtomicInt(&song->playerstate) > NATIVE_MIDI_STOPPED) {
-            if (write(song->mainsock, pkt_thread_cmd_quit, CMD_PKT_LEN) != sizeof(pkt_thread_cmd_quit)) {
-                return;
-            }
-        }
-        SDL_WaitThread(song->playerthread, NULL);
-        song->playerthread = NULL;
+    NativeMidi_Song *song = get_current_song();
+    if (song) {
+        SDL_LockMutex(song->lock);
+        stop_player(song);
+        SDL_UnlockMutex(song->lock);
     }
+    put_current_song(song);
 }
 
 bool NativeMidi_Active(void)
 {
-    NativeMidi_Song *song = currentsong;
-    return song ? (SDL_GetAtomicInt(&song->playerstate) > NATIVE_MIDI_STOPPED) : 0;
+    NativeMidi_Song *song = get_current_song();
+    const bool active = song ? (SDL_GetAtomicInt(&song->playerstate) > NATIVE_MIDI_STOPPED) : false;
+    put_current_song(song);
+    return active;
+}
+
+bool NativeMidi_GetPosition(Uint32 *ticks, Uint64 *ms)
+{
+    NativeMidi_Song *song = get_current_song();
+    const MIDITimeMap *map;
+    Uint32 tick;
+    Uint64 stamp;
+    Uint64 us;
+
+    if (!song || SDL_GetAtomicInt(&song->playerstate) == NATIVE_MIDI_STOPPED) {
+        put_current_song(song);
+        return SDL_SetError("No song is playing");
+    } else if (!(map = NativeMidi_GetSongTimeMap(song))) {
+        put_current_song(song);
+        return false;
+    }
+
+    /* Carry on from where the queue was by the time that has passed since, */
+    /* following the song's tempo changes, up to the end of the song */
+    load_position(song, &tick, &stamp);
+    us = NativeMidi_MapTicksToMicroseconds(map, tick);
+    if (stamp) {
+        const Uint64 now = SDL_GetTicksNS();
+        if (now > stamp) {
+            us += (now - stamp) / 1000;
+        }
+        tick = NativeMidi_MapMicrosecondsToTicks(map, us);
+        if (tick > map->endTime) {
+            tick = map->endTime;
+            us = NativeMidi_MapTicksToMicroseconds(map, tick);
+        }
+    }
+    put_current_song(song);
+
+    if (ticks) {
+        *ticks = tick;
+    }
+    if (ms) {
+        *ms = us / 1000;
+    }
+    return true;
 }
 
 void NativeMidi_SetVolume(float volume)
 {
-    NativeMidi_Song *song = currentsong;
+    NativeMidi_Song *song = get_current_song();
     if (song && (SDL_GetAtomicInt(&song->playerstate) == NATIVE_MIDI_PLAYING)) {
-        const int ivolume = (int) (SDL_clamp(volume, 0.0f, 1.0f) * 0x7F);
-        unsigned char pkt_thread_cmd_setvol[CMD_PKT_LEN] = { THREAD_CMD_SETVOL, (unsigned char) ivolume };
-        (void)!write(song->mainsock, pkt_thread_cmd_setvol, CMD_PKT_LEN);
+        /* Fades call this every frame; until the player thread has caught up with */
+        /* the last change, a new one only has to update the volume to set */
+        SDL_SetAtomicInt(&song->volume, (int) (SDL_clamp(volume, 0.0f, 1.0f) * 0x7F));
+        if (SDL_CompareAndSwapAtomicInt(&song->volpending, 0, 1)) {
+            send_cmd(song, THREAD_CMD_SETVOL);
+        }
     }
+    put_current_song(song);
+}
+
+NativeMidi_Destination *NativeMidi_GetDestinations(int *count)
+{
+    NativeMidi_Destination *dests = NULL;
+    int i;
+
+    if (!count) {
+        SDL_InvalidParamError("count");
+        return NULL;
+    } else if (!acquire_seq()) {
+        return NULL;
+    }
+
+    SDL_LockMutex(seq_mutex);
+    refresh_destinations(shared_seq, shared_port);
+    dests = (NativeMidi_Destination *)SDL_calloc(seq_ndests + 1, sizeof(*dests));
+    if (dests) {
+        for (i = 0; i < seq_ndests; i++) {
+            dests[i].id = ((Uint32)seq_dests[i].addr.client << 8) | seq_dests[i].addr.port;
+            SDL_strlcpy(dests[i].name, seq_dests[i].name, sizeof(dests[i].name));
+            dests[i].synth = (seq_dests[i].type & SND_SEQ_PORT_TYPE_SYNTHESIZER) != 0;
+            dests[i].connected = same_addr(&seq_dests[i].addr, &seq_connected);
+        }
+        *count = seq_ndests;
+    }
+    SDL_UnlockMutex(seq_mutex);
+
+    release_seq();
+    return dests;
+}
+
+bool NativeMidi_SelectDestination(Uint32 id)
+{
+    snd_seq_addr_t addr;
+    bool result = true;
+
+    if (id > 0xFFFF) {
+        return SDL_InvalidParamError("id");
+    } else if (!acquire_seq()) {
+        return false;
+    }
+
+    addr.client = (unsigned char)(id >> 8);
+    addr.port = (unsigned char)(id & 0xFF);
+
+    SDL_LockMutex(seq_mutex);
+    refresh_destinations(shared_seq, shared_port);
+    if (id && !find_destination(&addr)) {
+        result = SDL_SetError("No such destination");
+    } else {
+        /* Picking automatically starts over from scratch */
+        seq_selected = addr;
+        if (!id && seq_connected.client) {
+            ALSA_snd_seq_disconnect_to(shared_seq, shared_port, seq_connected.client, seq_connected.port);
+            SDL_zero(seq_connected);
+        }
+        update_connection(shared_seq, shared_port);
+    }
+    SDL_UnlockMutex(seq_mutex);
+
+    release_seq();
+    return result;
 }
 
 #endif
@@ -21,15 +21,37 @@
 
 #include "SDL_native_midi_common.h"
 
+#ifdef SDL_PLATFORM_UNIX
+#define MIDI_HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 // The constant 'MThd'
 #define MIDI_MAGIC	0x4d546864
 // The constant 'RIFF'
 #define RIFF_MAGIC	0x52494646
 
-// A single midi track as read from the midi file
+// Events the summary of a song is made of
+#define MIDI_SYSEX          0xF0
+#define MIDI_META_EVENT     0xFF
+#define MIDI_META_TEMPO     0x51
+#define MIDI_META_TIME_SIG  0x58
+
+// How many events lie between the checkpoints of a list
+#define CHECKPOINT_INTERVAL 4096
+
+// How fast songs play until they say otherwise: 120 beats per minute in 4/4
+#define DEFAULT_TEMPO       500000
+#define DEFAULT_NUMERATOR   4
+#define DEFAULT_DENOMINATOR 2
+
+// A single midi track as found in the midi file
 typedef struct
 {
-    Uint8 *data;                    // MIDI message stream
+    const Uint8 *data;              // MIDI message stream
     int len;                        // length of the track data
 } MIDITrack;
 
@@ -41,69 +63,359 @@ typedef struct
     MIDITrack *track;               // tracks
 } MIDIFile;
 
+// Every allocation carries its size in front, so that frees can be counted
+//  as well. This keeps the memory behind it aligned like SDL_malloc's.
+#define ALLOC_HEADER_SIZE   16
 
-// Get Variable Length Quantity
-static int GetVLQ(MIDITrack *track, int *currentPos)
+static SDL_SpinLock allocLock;
+static NativeMidi_MemoryStats allocStats;
+
+static void *TrackAlloc(void *ptr, size_t size)
 {
-    int l = 0;
-    Uint8 c;
-    while (1) {
-        c = track->data[*currentPos];
-        (*currentPos)++;
-        l += (c & 0x7f);
-        if (!(c & 0x80)) {
-            return l;
+    if (!ptr) {
+        return NULL;
+    }
+    *(size_t *)ptr = size;
+    SDL_LockSpinlock(&allocLock);
+    allocStats.live_allocations++;
+    allocStats.total_allocations++;
+    allocStats.live_bytes += size;
+    if (allocStats.live_bytes > allocStats.peak_bytes) {
+        allocStats.peak_bytes = allocStats.live_bytes;
+    }
+    SDL_UnlockSpinlock(&allocLock);
+    return (Uint8 *)ptr + ALLOC_HEADER_SIZE;
+}
+
+static void UntrackAlloc(size_t size)
+{
+    SDL_LockSpinlock(&allocLock);
+    allocStats.live_allocations--;
+    allocStats.live_bytes -= size;
+    SDL_UnlockSpinlock(&allocLock);
+}
+
+void *NativeMidi_malloc(size_t size)
+{
+    if (size > SDL_SIZE_MAX - ALLOC_HEADER_SIZE) {
+        SDL_OutOfMemory();
+        return NULL;
+    }
+    return TrackAlloc(SDL_malloc(ALLOC_HEADER_SIZE + size), size);
+}
+
+void *NativeMidi_calloc(size_t nmemb, size_t size)
+{
+    if (size && nmemb > (SDL_SIZE_MAX - ALLOC_HEADER_SIZE) / size) {
+        SDL_OutOfMemory();
+        return NULL;
+    }
+    return TrackAlloc(SDL_calloc(1, ALLOC_HEADER_SIZE + (nmemb * size)), nmemb * size);
+}
+
+void *NativeMidi_realloc(void *mem, size_t size)
+{
+    size_t oldsize;
+    void *ptr;
+
+    if (!mem) {
+        return NativeMidi_malloc(size);
+    }
+    if (size > SDL_SIZE_MAX - ALLOC_HEADER_SIZE) {
+        SDL_OutOfMemory();
+        return NULL;
+    }
+    oldsize = NativeMidi_GetAllocSize(mem);
+    ptr = SDL_realloc((Uint8 *)mem - ALLOC_HEADER_SIZE, ALLOC_HEADER_SIZE + size);
+    if (!ptr) {
+        return NULL;
+    }
+    UntrackAlloc(oldsize);
+    return TrackAlloc(ptr, size);
+}
+
+void NativeMidi_free(void *mem)
+{
+    if (mem) {
+        UntrackAlloc(NativeMidi_GetAllocSize(mem));
+        SDL_free((Uint8 *)mem - ALLOC_HEADER_SIZE);
+    }
+}
+
+size_t NativeMidi_GetAllocSize(const void *mem)
+{
+    return *(const size_t *)((const Uint8 *)mem - ALLOC_HEADER_SIZE);
+}
+
+void NativeMidi_GetMemoryStats(NativeMidi_MemoryStats *stats)
+{
+    if (!stats) {
+        return;
+    }
+    SDL_LockSpinlock(&allocLock);
+    *stats = allocStats;
+    SDL_UnlockSpinlock(&allocLock);
+}
+
+// Arena blocks are at least this big, so small allocations share them
+#define ARENA_BLOCK_SIZE    (64 * 1024)
+// Every arena allocation is rounded up to a multiple of this
+#define ARENA_ALIGN         16
+#define ARENA_ROUND(x)      (((x) + (ARENA_ALIGN - 1)) & ~((size_t)ARENA_ALIGN - 1))
+
+typedef struct MIDIArenaBlock
+{
+    struct MIDIArenaBlock *next;    // previously filled block
+    size_t size;                    // usable bytes in this block
+    size_t used;                    // bytes handed out so far
+} MIDIArenaBlock;
+
+struct MIDIArena
+{
+    MIDIArenaBlock *blocks;         // current block, the rest chain from it
+};
+
+#define ARENA_HEADER_SIZE   ARENA_ROUND(sizeof(MIDIArenaBlock))
+
+static MIDIArenaBlock *NewArenaBlock(size_t size)
+{
+    MIDIArenaBlock *block = (MIDIArenaBlock *) NativeMidi_malloc(ARENA_HEADER_SIZE + size);
+    if (block) {
+        block->next = NULL;
+        block->size = size;
+        block->used = 0;
+    }
+    return block;
+}
+
+MIDIArena *NativeMidi_CreateArena(size_t initialSize)
+{
+    // The arena itself lives at the start of its first block
+    MIDIArenaBlock *block = NewArenaBlock(ARENA_ROUND(sizeof(MIDIArena)) + ARENA_ROUND(initialSize) + ARENA_ALIGN);
+    MIDIArena *arena;
+
+    if (!block) {
+        return NULL;
+    }
+    arena = (MIDIArena *) ((Uint8 *) block + ARENA_HEADER_SIZE);
+    block->used = ARENA_ROUND(sizeof(MIDIArena));
+    arena->blocks = block;
+    return arena;
+}
+
+void *NativeMidi_ArenaAlloc(MIDIArena *arena, size_t len)
+{
+    MIDIArenaBlock *block = arena->blocks;
+    void *ptr;
+
+    len = ARENA_ROUND(len);
+    if (len > block->size - block->used) {
+        // Big requests get a block of their own, the rest start a fresh one
+        block = NewArenaBlock(SDL_max(len, ARENA_BLOCK_SIZE));
+        if (!block) {
+            return NULL;
         }
-        l <<= 7;
+        block->next = arena->blocks;
+        arena->blocks = block;
     }
+
+    ptr = (Uint8 *) block + ARENA_HEADER_SIZE + block->used;
+    block->used += len;
+    return ptr;
 }
 
-// Create a single MIDIEvent
-static MIDIEvent *CreateMIDIEvent(Uint32 time, Uint8 event, Uint8 a, Uint8 b)
+// Get how much memory an arena takes up, including its own bookkeeping
+static size_t ArenaSize(const MIDIArena *arena)
 {
-    MIDIEvent *newEvent;
+    const MIDIArenaBlock *block;
+    size_t size = 0;
 
-    newEvent = SDL_calloc(1, sizeof(MIDIEvent));
+    for (block = arena->blocks; block; block = block->next) {
+        size += ARENA_HEADER_SIZE + block->size;
+    }
+    return size;
+}
+
+// Check whether memory was handed out by an arena
+static bool ArenaContains(const MIDIArena *arena, const void *ptr)
+{
+    const MIDIArenaBlock *block;
 
-    if (newEvent) {
-        newEvent->time = time;
-        newEvent->status = event;
-        newEvent->data[0] = a;
-        newEvent->data[1] = b;
+    for (block = arena->blocks; block; block = block->next) {
+        const Uint8 *start = (const Uint8 *) block + ARENA_HEADER_SIZE;
+        if ((const Uint8 *) ptr >= start && (const Uint8 *) ptr < start + block->used) {
+            return true;
+        }
     }
+    return false;
+}
+
+static void AddArenaStats(const MIDIArena *arena, NativeMidi_SongStats *stats)
+{
+    const MIDIArenaBlock *block;
 
-    return newEvent;
+    for (block = arena->blocks; block; block = block->next) {
+        stats->allocations++;
+    }
+    stats->resident_bytes += ArenaSize(arena);
 }
 
-// Convert a single midi track to a list of MIDIEvents
-static MIDIEvent *MIDITracktoStream(MIDITrack *track)
+void NativeMidi_DestroyArena(MIDIArena *arena)
 {
-    Uint32 atime = 0;
-    Uint32 len = 0;
-    Uint8 event,type,a,b;
-    Uint8 laststatus = 0;
-    Uint8 lastchan = 0;
-    int currentPos = 0;
-    int end = 0;
-    MIDIEvent *head = CreateMIDIEvent(0,0,0,0); // dummy event to make handling the list easier
-    MIDIEvent *currentEvent = head;
+    MIDIArenaBlock *block;
 
-    while (!end) {
-        if (currentPos >= track->len) {
-            break; // End of data stream reached
+    if (!arena) {
+        return;
+    }
+
+    // Walk the chain up to (and including) the block the arena lives in
+    block = arena->blocks;
+    while (block) {
+        MIDIArenaBlock *next = block->next;
+        NativeMidi_free(block);
+        block = next;
+    }
+}
+
+// IO stream property holding the MIDIMapping a memory stream reads from
+#define MIDI_PROP_MAPPING   "SDL_native_midi.mapping"
+
+struct MIDIMapping
+{
+    void *data;
+    size_t len;
+    bool mapped;                    // mapped with mmap, or else from SDL_malloc
+    SDL_AtomicInt refcount;
+};
+
+static void ReleaseMapping(MIDIMapping *mapping)
+{
+    if (mapping && SDL_AtomicDecRef(&mapping->refcount)) {
+#ifdef MIDI_HAVE_MMAP
+        if (mapping->mapped) {
+            munmap(mapping->data, mapping->len);
+        } else
+#endif
+        {
+            SDL_free(mapping->data);
+        }
+        NativeMidi_free(mapping);
+    }
+}
+
+// Mapped files are paged in as needed; files read into memory are resident
+static void AddMappingStats(const MIDIMapping *mapping, NativeMidi_SongStats *stats)
+{
+    if (mapping->mapped) {
+        stats->mapped_bytes += mapping->len;
+    } else {
+        stats->allocations++;
+        stats->resident_bytes += mapping->len;
+    }
+}
+
+// Payloads written so far, with a hash table to find identical ones again
+typedef struct
+{
+    Uint32 hash;
+    Uint32 offset;
+    Uint32 len;                     // 0 marks an empty slot
+} MIDIPayloadSlot;
+
+typedef struct
+{
+    Uint8 *data;                    // unique payloads, back to back
+    Uint32 len;
+    MIDIPayloadSlot *slots;
+    Uint32 mask;                    // number of slots - 1
+} MIDIPayloadTable;
+
+// Store a payload unless an identical one is already stored; returns its offset
+static Uint32 InternPayload(MIDIPayloadTable *table, const Uint8 *data, Uint32 len)
+{
+    const Uint32 hash = SDL_murmur3_32(data, len, 0);
+    Uint32 i = hash & table->mask;
+    MIDIPayloadSlot *slot;
+
+    while ((slot = &table->slots[i])->len) {
+        if (slot->hash == hash && slot->len == len && SDL_memcmp(table->data + slot->offset, data, len) == 0) {
+            return slot->offset;
+        }
+        i = (i + 1) & table->mask;
+    }
+
+    slot->hash = hash;
+    slot->offset = table->len;
+    slot->len = len;
+    SDL_memcpy(table->data + table->len, data, len);
+    table->len += len;
+    return slot->offset;
+}
+
+// Decoding state of a single track
+typedef struct
+{
+    const MIDITrack *track;
+    int pos;                        // read position in the track data
+    Uint32 time;                    // absolute time of the last event
+    Uint8 laststatus;               // running status
+    Uint8 lastchan;
+    bool end;                       // end of track reached
+} MIDITrackCursor;
+
+
+// Get Variable Length Quantity; fails if the track ends in the middle of it
+static bool GetVLQ(MIDITrackCursor *cursor, Uint32 *value)
+{
+    const MIDITrack *track = cursor->track;
+    Uint32 l = 0;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        Uint8 c;
+        if (cursor->pos >= track->len) {
+            return false;
+        }
+        c = track->data[cursor->pos++];
+        l += (c & 0x7f);
+        if (!(c & 0x80)) {
+            *value = l;
+            return true;
         }
+        l <<= 7;
+    }
+    return false; // A VLQ is at most 4 bytes long
+}
+
+// Decode the next event of a track. Extra data, if any, is left in the track
+//  data and *extra is pointed at it. Returns false at the end of the track;
+//  a truncated track simply ends early.
+static bool NextTrackEvent(MIDITrackCursor *cursor, MIDIEvent *event, const Uint8 **extra)
+{
+    const MIDITrack *track = cursor->track;
+    Uint32 delta, len;
+    Uint8 status, type, a, b;
 
-        atime += GetVLQ(track, &currentPos);
-        event = track->data[currentPos++];
+    while (!cursor->end) {
+        if (cursor->pos >= track->len) {
+            break; // End of data stream reached
+        }
+        if (!GetVLQ(cursor, &delta) || cursor->pos >= track->len) {
+            break;
+        }
+        cursor->time += delta;
+        status = track->data[cursor->pos++];
 
         // Handle SysEx seperatly
-        if (((event>>4) & 0x0F) == MIDI_STATUS_SYSEX) {
-            if (event == 0xFF) {
-                type = track->data[currentPos];
-                currentPos++;
+        if (((status>>4) & 0x0F) == MIDI_STATUS_SYSEX) {
+            if (status == 0xFF) {
+                if (cursor->pos >= track->len) {
+                    break;
+                }
+                type = track->data[cursor->pos++];
                 switch(type) {
                     case 0x2f: // End of data marker
-                        end = 1;
+                        cursor->end = true;
                     case 0x51: // Tempo change
                         /*
                         a=track->data[currentPos];
@@ -117,283 +429,2745 @@ static MIDIEvent *MIDITracktoStream(MIDITrack *track)
                 type = 0;
             }
 
-            len = GetVLQ(track, &currentPos);
-
-            // Create an event and attach the extra data, if any
-            currentEvent->next = CreateMIDIEvent(atime, event, type, 0);
-            currentEvent = currentEvent->next;
-            if (NULL == currentEvent) {
-                NativeMidi_FreeMIDIEventList(head);
-                return NULL;
-            }
-            if (len) {
-                currentEvent->extraLen = len;
-                currentEvent->extraData = SDL_malloc(len);
-                SDL_memcpy(currentEvent->extraData, &(track->data[currentPos]), len);
-                currentPos += len;
-            }
-        } else {
-            a = event;
-            if (a & 0x80) { // It's a status byte
-                // Extract channel and status information
-                lastchan = a & 0x0F;
-                laststatus = (a>>4) & 0x0F;
-
-                // Read the next byte which should always be a data byte
-                a = track->data[currentPos++] & 0x7F;
+            if (!GetVLQ(cursor, &len) || len > (Uint32)(track->len - cursor->pos)) {
+                break;
             }
-            switch(laststatus) {
-                case MIDI_STATUS_NOTE_OFF:
-                case MIDI_STATUS_NOTE_ON: // Note on
-                case MIDI_STATUS_AFTERTOUCH: // Key Pressure
-                case MIDI_STATUS_CONTROLLER: // Control change
-                case MIDI_STATUS_PITCH_WHEEL: // Pitch wheel
-                    b = track->data[currentPos++] & 0x7F;
-                    currentEvent->next = CreateMIDIEvent(atime, (Uint8)((laststatus<<4)+lastchan), a, b);
-                    currentEvent = currentEvent->next;
-                    if (NULL == currentEvent) {
-                        NativeMidi_FreeMIDIEventList(head);
-                        return NULL;
-                    }
-                    break;
 
-                case MIDI_STATUS_PROG_CHANGE: // Program change
-                case MIDI_STATUS_PRESSURE: // Channel pressure
-                    a &= 0x7f;
-                    currentEvent->next = CreateMIDIEvent(atime, (Uint8)((laststatus<<4)+lastchan), a, 0);
-                    currentEvent = currentEvent->next;
-                    if (NULL == currentEvent) {
-                        NativeMidi_FreeMIDIEventList(head);
-                        return NULL;
-                    }
-                    break;
+            event->time = cursor->time;
+            event->status = status;
+            event->data[0] = type;
+            event->data[1] = 0;
+            event->extraLen = len;
+            event->extraOffset = 0;
+            *extra = &track->data[cursor->pos];
+            cursor->pos += len;
+            return true;
+        }
 
-                default: // Sysex already handled above
-                    break;
+        a = status;
+        if (a & 0x80) { // It's a status byte
+            // Extract channel and status information
+            cursor->lastchan = a & 0x0F;
+            cursor->laststatus = (a>>4) & 0x0F;
+
+            // Read the next byte which should always be a data byte
+            if (cursor->pos >= track->len) {
+                break;
             }
+            a = track->data[cursor->pos++] & 0x7F;
+        }
+        switch(cursor->laststatus) {
+            case MIDI_STATUS_NOTE_OFF:
+            case MIDI_STATUS_NOTE_ON: // Note on
+            case MIDI_STATUS_AFTERTOUCH: // Key Pressure
+            case MIDI_STATUS_CONTROLLER: // Control change
+            case MIDI_STATUS_PITCH_WHEEL: // Pitch wheel
+                if (cursor->pos >= track->len) {
+                    goto end_of_track;
+                }
+                b = track->data[cursor->pos++] & 0x7F;
+                break;
+
+            case MIDI_STATUS_PROG_CHANGE: // Program change
+            case MIDI_STATUS_PRESSURE: // Channel pressure
+                a &= 0x7f;
+                b = 0;
+                break;
+
+            default: // Sysex already handled above
+                continue;
         }
+
+        event->time = cursor->time;
+        event->status = (Uint8)((cursor->laststatus<<4)+cursor->lastchan);
+        event->data[0] = a;
+        event->data[1] = b;
+        event->extraLen = 0;
+        event->extraOffset = 0;
+        *extra = NULL;
+        return true;
     }
 
-    currentEvent = head->next;
-    SDL_free(head); // release the dummy head event
-    return currentEvent;
+end_of_track:
+    cursor->end = true;
+    return false;
 }
 
-/*
- *  Convert a midi song, consisting of up to 32 tracks, to a list of MIDIEvents.
- *  To do so, first convert the tracks seperatly, then interweave the resulting
- *  MIDIEvent-Lists to one big list.
- */
-static MIDIEvent *MIDItoStream(MIDIFile *mididata)
+// What counting a track found out
+typedef struct
 {
-    MIDIEvent **track;
-    MIDIEvent *head = CreateMIDIEvent(0,0,0,0); // dummy event to make handling the list easier
-    MIDIEvent *currentEvent = head;
-    int trackID;
-
-    if (NULL == head) {
-        return NULL;
-    }
+    Uint32 nEvents;                 // number of events
+    Uint32 nExtra;                  // number of events with extra data
+    Uint32 payloadLen;              // total length of that extra data
+} MIDITrackInfo;
 
-    track = (MIDIEvent**) SDL_calloc(1, sizeof(MIDIEvent*) * mididata->nTracks);
-    if (NULL == track) {
-        SDL_free(head);
-        return NULL;
-    }
+// Count the events of a single midi track, how many carry extra data, and how much
+static void CountTrackEvents(const MIDITrack *track, MIDITrackInfo *info)
+{
+    MIDITrackCursor cursor;
+    MIDIEvent event;
+    const Uint8 *extra;
 
-    // First, convert all tracks to MIDIEvent lists
-    for (trackID = 0; trackID < mididata->nTracks; trackID++) {
-        track[trackID] = MIDITracktoStream(&mididata->track[trackID]);
+    SDL_zero(cursor);
+    SDL_zerop(info);
+    cursor.track = track;
+    while (NextTrackEvent(&cursor, &event, &extra)) {
+        info->nEvents++;
+        if (event.extraLen) {
+            info->nExtra++;
+            info->payloadLen += event.extraLen;
+        }
     }
+}
 
-    // Now, merge the lists.
-    // TODO
-    while (1) {
-        Uint32 lowestTime = 0x7FFFFFFF; // INT_MAX
-        int currentTrackID = -1;
+// Convert a single midi track to MIDIEvents, sized with CountTrackEvents.
+//  Extra data is left where it is, and referenced relative to base.
+static void MIDITracktoStream(const MIDITrack *track, MIDIEvent *events, const Uint8 *base)
+{
+    MIDITrackCursor cursor;
+    const Uint8 *extra;
 
-        // Find the next event
-        for (trackID = 0; trackID < mididata->nTracks; trackID++) {
-            if (track[trackID] && (track[trackID]->time < lowestTime)) {
-                currentTrackID = trackID;
-                lowestTime = track[currentTrackID]->time;
-            }
+    SDL_zero(cursor);
+    cursor.track = track;
+    while (NextTrackEvent(&cursor, events, &extra)) {
+        if (events->extraLen) {
+            events->extraOffset = (Uint32)(extra - base);
         }
+        events++;
+    }
+}
 
-        // Check if we processes all events
-        if (currentTrackID == -1) {
-            break;
-        }
+// Tracks don't depend on each other, so large files can have them counted
+//  and converted by several threads at once. Each thread grabs the next
+//  track nobody has taken yet until none are left.
+#define MAX_DECODE_THREADS          16
+#define DEFAULT_PARALLEL_THRESHOLD  (256 * 1024)
 
-        currentEvent->next = track[currentTrackID];
-        track[currentTrackID] = track[currentTrackID]->next;
+typedef struct
+{
+    const MIDIFile *mididata;
+    const Uint8 *base;              // extra data is referenced relative to this
+    MIDITrackInfo *info;            // filled in when counting...
+    const Uint32 *trackStart;       // ...and used to place events when converting
+    MIDIEvent *events;              // NULL when counting
+    SDL_AtomicInt nextTrack;
+} MIDIDecodeJob;
 
-        currentEvent = currentEvent->next;
+static int SDLCALL DecodeTracksThread(void *data)
+{
+    MIDIDecodeJob *job = (MIDIDecodeJob *) data;
+    int trackID;
 
-        lowestTime = 0;
+    while ((trackID = SDL_AddAtomicInt(&job->nextTrack, 1)) < job->mididata->nTracks) {
+        const MIDITrack *track = &job->mididata->track[trackID];
+        if (job->events) {
+            MIDITracktoStream(track, &job->events[job->trackStart[trackID]], job->base);
+        } else {
+            CountTrackEvents(track, &job->info[trackID]);
+        }
     }
+    return 0;
+}
 
-    // Make sure the list is properly terminated
-    currentEvent->next = 0;
+// Run a job on nThreads threads, including the calling one. If threads
+//  can't be created, whoever is running picks up the slack.
+static void RunDecodeJob(MIDIDecodeJob *job, int nThreads)
+{
+    SDL_Thread *threads[MAX_DECODE_THREADS];
+    int started = 0;
+    int i;
 
-    currentEvent = head->next;
-    SDL_free(track);
-    SDL_free(head); // release the dummy head event
-    return currentEvent;
+    SDL_SetAtomicInt(&job->nextTrack, 0);
+    for (i = 1; i < nThreads; i++) {
+        threads[started] = SDL_CreateThread(DecodeTracksThread, "SDL_MIDI_decode", job);
+        if (threads[started]) {
+            started++;
+        }
+    }
+    DecodeTracksThread(job);
+    for (i = 0; i < started; i++) {
+        SDL_WaitThread(threads[i], NULL);
+    }
 }
 
-static int ReadMIDIFile(MIDIFile *mididata, SDL_IOStream *src)
+// How many threads to decode a file with. Parallel decoding is off unless
+//  the SDL_NATIVE_MIDI_PARALLEL_DECODE hint is set, and small files aren't
+//  worth the thread startup cost either way.
+static int DecodeThreadCount(const MIDIFile *mididata)
 {
-    int i = -1;
-    Uint32 ID = 0;
-    Uint32 size = 0;
-    Uint16 format = 0;
-    Uint16 tracks = 0;
-    Uint16 division = 0;
+    const char *hint;
+    size_t threshold = DEFAULT_PARALLEL_THRESHOLD;
+    size_t total = 0;
+    int nThreads;
+    int trackID;
 
-    if (!mididata) {
-        return 0;
-    }
-    if (!src) {
-        return 0;
+    if (mididata->nTracks < 2 || !SDL_GetHintBoolean("SDL_NATIVE_MIDI_PARALLEL_DECODE", false)) {
+        return 1;
     }
 
-    // Make sure this is really a MIDI file
-    if (!SDL_ReadU32BE(src, &ID)) {
-        return 0;
+    hint = SDL_GetHint("SDL_NATIVE_MIDI_PARALLEL_DECODE_THRESHOLD");
+    if (hint && *hint) {
+        threshold = (size_t)SDL_strtoul(hint, NULL, 0);
     }
-    if (ID == RIFF_MAGIC) {
-        SDL_SeekIO(src, 16, SDL_IO_SEEK_CUR);
-        if (!SDL_ReadU32BE(src, &ID)) {
-            return 0;
-        }
+    for (trackID = 0; trackID < mididata->nTracks; trackID++) {
+        total += (size_t)mididata->track[trackID].len;
     }
-    if (ID != MIDI_MAGIC) {
-        return 0;
+    if (total < threshold) {
+        return 1;
     }
 
-    // Header size must be 6
-    if (!SDL_ReadU32BE(src, &size)) {
-        return 0;
-    }
-    if (size != 6) {
-        return 0;
-    }
+    nThreads = SDL_min(SDL_GetNumLogicalCPUCores(), mididata->nTracks);
+    return SDL_clamp(nThreads, 1, MAX_DECODE_THREADS);
+}
 
-    // We only support format 0 and 1, but not 2
-    if (!SDL_ReadU16BE(src, &format)) {
-        return 0;
-    } else if (format != 0 && format != 1) {
-        return 0;
-    }
+// Copy the extra data of all events from the file into the list's arena,
+//  storing identical payloads only once.
+static bool StorePayload(MIDIEventList *list, MIDIEvent *events, const Uint8 *base, Uint32 nExtra, Uint32 payloadLen, MIDIArena *temp)
+{
+    MIDIPayloadTable payload;
+    Uint32 nSlots = 1;
+    Uint32 i;
+    Uint8 *data;
 
-    if (!SDL_ReadU16BE(src, &tracks)) {
-        return 0;
+    list->payload = NULL;
+    list->payloadLen = 0;
+    if (nExtra == 0) {
+        return true;
     }
-    mididata->nTracks = tracks;
 
-    // Allocate tracks
-    mididata->track = (MIDITrack*) SDL_calloc(1, sizeof(MIDITrack) * mididata->nTracks);
-    if (NULL == mididata->track) {
-        goto bail;
+    // Payloads are interned in temp first; only the unique ones are kept
+    while (nSlots < nExtra * 2) {
+        nSlots <<= 1;
     }
-
-    // Retrieve the PPQN value, needed for playback
-    if (!SDL_ReadU16BE(src, &division)) {
-        goto bail;
+    payload.data = (Uint8 *) NativeMidi_ArenaAlloc(temp, payloadLen);
+    payload.len = 0;
+    payload.slots = (MIDIPayloadSlot *) NativeMidi_ArenaAlloc(temp, sizeof(MIDIPayloadSlot) * nSlots);
+    payload.mask = nSlots - 1;
+    if (NULL == payload.data || NULL == payload.slots) {
+        return false;
     }
-    mididata->division = division;
+    SDL_memset(payload.slots, 0, sizeof(MIDIPayloadSlot) * nSlots);
 
-    for (i = 0; i < tracks; i++) {
-        if (!SDL_ReadU32BE(src, &ID)) {
-            goto bail;
-        } else if (!SDL_ReadU32BE(src, &size)) {
-            goto bail;
-        }
-        mididata->track[i].len = size;
-        mididata->track[i].data = SDL_malloc(size);
-        if (!mididata->track[i].data) {
-            goto bail;
-        }
-        if (SDL_ReadIO(src, mididata->track[i].data, size) != size) {
-            goto bail;
+    for (i = 0; i < list->nEvents; i++) {
+        MIDIEvent *event = &events[i];
+        if (event->extraLen) {
+            event->extraOffset = InternPayload(&payload, base + event->extraOffset, event->extraLen);
         }
     }
-    return 1;
 
-bail:
-    for (; i >= 0; i--) {
-        if (mididata->track[i].data) {
-            SDL_free(mididata->track[i].data);
-        }
+    data = (Uint8 *) NativeMidi_ArenaAlloc(list->arena, payload.len);
+    if (NULL == data) {
+        return false;
     }
+    SDL_memcpy(data, payload.data, payload.len);
+    list->payload = data;
+    list->payloadLen = payload.len;
+    return true;
+}
 
-    SDL_free(mididata->track);
-    return 0;
+static SDL_INLINE bool IsTempoEvent(const MIDIEvent *event)
+{
+    return event->status == MIDI_META_EVENT && event->data[0] == MIDI_META_TEMPO && event->extraLen == 3;
 }
 
-MIDIEvent *NativeMidi_CreateMIDIEventList(SDL_IOStream *src, Uint16 *division)
+static SDL_INLINE bool IsTimeSigEvent(const MIDIEvent *event)
 {
-    MIDIFile *mididata = NULL;
-    MIDIEvent *eventList;
-    int trackID;
+    return event->status == MIDI_META_EVENT && event->data[0] == MIDI_META_TIME_SIG && event->extraLen >= 4;
+}
 
-    mididata = SDL_calloc(1, sizeof(MIDIFile));
-    if (!mididata) {
-        return NULL;
-    }
+static void ReadTempo(MIDITempo *tempo, const MIDIEvent *event, const Uint8 *extra)
+{
+    tempo->time = event->time;
+    tempo->tempo = ((Uint32)extra[0] << 16) | ((Uint32)extra[1] << 8) | extra[2];
+}
 
-    // Open the file
-    if (src != NULL) {
-        // Read in the data
-        if (!ReadMIDIFile(mididata, src)) {
-            SDL_free(mididata);
-            return NULL;
-        }
-    } else {
-        SDL_free(mididata);
-        return NULL;
-    }
+static void ReadTimeSig(MIDITimeSig *timeSig, const MIDIEvent *event, const Uint8 *extra)
+{
+    timeSig->time = event->time;
+    timeSig->numerator = extra[0];
+    timeSig->denominator = extra[1];
+    timeSig->clocks = extra[2];
+    timeSig->notated32nds = extra[3];
+}
 
-    if (division) {
-        *division = mididata->division;
+// Ticks per quarter note. SMPTE-timed songs don't have quarter notes, so a
+//  second stands in for one.
+static Uint32 TicksPerQuarter(const MIDITimeMap *map)
+{
+    if (map->division & 0x8000) {
+        const int fps = -(Sint8)(map->division >> 8);
+        return SDL_max((Uint32)(fps == 29 ? 30 : fps) * (map->division & 0xFF), 1);
     }
+    return SDL_max(map->division, 1);
+}
 
-    eventList = MIDItoStream(mididata);
-    if (eventList == NULL) {
-        SDL_free(mididata);
-        return NULL;
-    }
-    for (trackID = 0; trackID < mididata->nTracks; trackID++) {
-        if (mididata->track[trackID].data) {
-            SDL_free(mididata->track[trackID].data);
-        }
+// The microseconds a number of ticks take at a tempo
+static Uint64 TicksToMicroseconds(const MIDITimeMap *map, Uint64 ticks, Uint32 tempo)
+{
+    if (map->division & 0x8000) {
+        // Frames per 100 seconds, as 29 stands for 29.97 fps
+        const int fps = -(Sint8)(map->division >> 8);
+        const Uint64 rate = SDL_max((Uint64)(fps == 29 ? 2997 : fps * 100) * (map->division & 0xFF), 1);
+        return (ticks * 100000000) / rate;
     }
-    SDL_free(mididata->track);
-    SDL_free(mididata);
-
-    return eventList;
+    return (ticks * tempo) / SDL_max(map->division, 1);
 }
 
-void NativeMidi_FreeMIDIEventList(MIDIEvent *head)
+// The ticks that fit into a number of microseconds at a tempo
+static Uint64 MicrosecondsToTicks(const MIDITimeMap *map, Uint64 us, Uint32 tempo)
 {
-    MIDIEvent *cur, *next;
-
-    cur = head;
+    Uint64 ticks;
 
-    while (cur) {
-        next = cur->next;
-        if (cur->extraData) {
-            SDL_free(cur->extraData);
-        }
-        SDL_free(cur);
-        cur = next;
+    if (map->division & 0x8000) {
+        const int fps = -(Sint8)(map->division >> 8);
+        const Uint64 rate = (Uint64)(fps == 29 ? 2997 : fps * 100) * (map->division & 0xFF);
+        ticks = ((us / 100000000) * rate) + (((us % 100000000) * rate) / 100000000);
+    } else if (tempo == 0) {
+        return 0;
+    } else {
+        ticks = ((us / tempo) * map->division) + (((us % tempo) * map->division) / tempo);
     }
+    return SDL_min(ticks, SDL_MAX_UINT32);
 }
 
-NativeMidi_Song *NativeMidi_LoadSong(const char *path)
+// The length of a beat and a bar under a time signature, or the default one
+static void GetBarLength(const MIDITimeMap *map, const MIDITimeSig *timeSig, Uint32 *beatTicks, Uint32 *barTicks)
 {
-    SDL_IOStream *io = SDL_IOFromFile(path, "rb");
-    return io ? NativeMidi_LoadSong_IO(io, true) : NULL;
+    const Uint32 numerator = timeSig ? SDL_max(timeSig->numerator, 1) : DEFAULT_NUMERATOR;
+    const Uint32 denominator = timeSig ? timeSig->denominator : DEFAULT_DENOMINATOR;
+    const Uint64 whole = (Uint64)TicksPerQuarter(map) * 4;
+
+    *beatTicks = (Uint32)SDL_max(denominator < 32 ? (whole >> denominator) : 0, 1);
+    *barTicks = (Uint32)SDL_min((Uint64)*beatTicks * numerator, SDL_MAX_UINT32);
 }
 
+// Work out where every tempo change and time signature of a map starts
+static bool IndexTimeMap(MIDITimeMap *map, MIDIArena *arena)
+{
+    Uint64 *tempoStart = NULL;
+    Uint32 *timeSigBar = NULL;
+    Uint64 us = 0;
+    Uint64 bar = 0;
+    Uint32 time = 0;
+    Uint32 tempo = DEFAULT_TEMPO;
+    Uint32 beatTicks, barTicks;
+    Uint32 i;
+
+    if (map->nTempo) {
+        tempoStart = (Uint64 *) NativeMidi_ArenaAlloc(arena, sizeof(Uint64) * map->nTempo);
+    }
+    if (map->nTimeSig) {
+        timeSigBar = (Uint32 *) NativeMidi_ArenaAlloc(arena, sizeof(Uint32) * map->nTimeSig);
+    }
+    if ((map->nTempo && !tempoStart) || (map->nTimeSig && !timeSigBar)) {
+        return false;
+    }
+
+    for (i = 0; i < map->nTempo; i++) {
+        us += TicksToMicroseconds(map, map->tempo[i].time - time, tempo);
+        tempoStart[i] = us;
+        time = map->tempo[i].time;
+        tempo = map->tempo[i].tempo;
+    }
+
+    // A time signature starts a new bar, even if the last one isn't full yet
+    time = 0;
+    GetBarLength(map, NULL, &beatTicks, &barTicks);
+    for (i = 0; i < map->nTimeSig; i++) {
+        const MIDITimeSig *timeSig = &map->timeSig[i];
+        bar += ((Uint64)(timeSig->time - time) + barTicks - 1) / barTicks;
+        timeSigBar[i] = (Uint32)SDL_min(bar, SDL_MAX_UINT32);
+        time = timeSig->time;
+        GetBarLength(map, timeSig, &beatTicks, &barTicks);
+    }
+
+    map->tempoStart = tempoStart;
+    map->timeSigBar = timeSigBar;
+    return true;
+}
+
+// How much memory a copy of a time map takes up with CopyTimeMapTo
+static size_t GetTimeMapCopySize(const MIDITimeMap *map)
+{
+    return ARENA_ROUND(sizeof(MIDITimeMap)) + ARENA_ROUND(sizeof(MIDITempo) * map->nTempo) +
+           ARENA_ROUND(sizeof(Uint64) * map->nTempo) + ARENA_ROUND(sizeof(MIDITimeSig) * map->nTimeSig) +
+           ARENA_ROUND(sizeof(Uint32) * map->nTimeSig);
+}
+
+// Copy a time map into a single block of GetTimeMapCopySize bytes
+static MIDITimeMap *CopyTimeMapTo(const MIDITimeMap *map, void *mem)
+{
+    MIDITimeMap *copy = (MIDITimeMap *) mem;
+    Uint8 *data;
+
+    *copy = *map;
+    data = (Uint8 *) copy + ARENA_ROUND(sizeof(MIDITimeMap));
+    copy->tempoStart = (const Uint64 *) SDL_memcpy(data, map->tempoStart, sizeof(Uint64) * map->nTempo);
+    data += ARENA_ROUND(sizeof(Uint64) * map->nTempo);
+    copy->tempo = (const MIDITempo *) SDL_memcpy(data, map->tempo, sizeof(MIDITempo) * map->nTempo);
+    data += ARENA_ROUND(sizeof(MIDITempo) * map->nTempo);
+    copy->timeSig = (const MIDITimeSig *) SDL_memcpy(data, map->timeSig, sizeof(MIDITimeSig) * map->nTimeSig);
+    data += ARENA_ROUND(sizeof(MIDITimeSig) * map->nTimeSig);
+    copy->timeSigBar = (const Uint32 *) SDL_memcpy(data, map->timeSigBar, sizeof(Uint32) * map->nTimeSig);
+    return copy;
+}
+
+void NativeMidi_ResetChaseState(MIDIChaseState *state)
+{
+    state->tempo = 0;
+    SDL_memset(state->channel, MIDI_CHASE_UNSET, sizeof(state->channel));
+}
+
+void NativeMidi_ChaseEvent(MIDIChaseState *state, const MIDIEvent *event, const Uint8 *extra)
+{
+    MIDIChannelState *channel = &state->channel[event->status & 0x0F];
+
+    switch (event->status >> 4) {
+        case MIDI_STATUS_CONTROLLER:
+            if (event->data[0] < SDL_arraysize(channel->controller)) {
+                channel->controller[event->data[0]] = event->data[1];
+            } else if (event->data[0] == 121) {
+                // Reset All Controllers: back to what the synth starts out with
+                SDL_memset(channel->controller, MIDI_CHASE_UNSET, sizeof(channel->controller));
+                channel->bend[0] = channel->bend[1] = MIDI_CHASE_UNSET;
+            }
+            break;
+        case MIDI_STATUS_PROG_CHANGE:
+            channel->program = event->data[0];
+            break;
+        case MIDI_STATUS_PITCH_WHEEL:
+            channel->bend[0] = event->data[0];
+            channel->bend[1] = event->data[1];
+            break;
+        case MIDI_STATUS_SYSEX:
+            if (IsTempoEvent(event)) {
+                state->tempo = ((Uint32)extra[0] << 16) | ((Uint32)extra[1] << 8) | extra[2];
+            }
+            break;
+    }
+}
+
+// Take a snapshot of the chase state every CHECKPOINT_INTERVAL events, so
+//  seeking only has to replay the events since the last one.
+static bool IndexCheckpoints(MIDIEventList *list)
+{
+    const Uint32 nCheckpoints = list->nEvents / CHECKPOINT_INTERVAL;
+    MIDIChaseState *checkpoints;
+    MIDIChaseState state;
+    Uint32 i;
+
+    list->checkpoints = NULL;
+    list->nCheckpoints = 0;
+    if (nCheckpoints == 0) {
+        return true;
+    }
+
+    checkpoints = (MIDIChaseState *) NativeMidi_ArenaAlloc(list->arena, sizeof(MIDIChaseState) * nCheckpoints);
+    if (!checkpoints) {
+        return false;
+    }
+    NativeMidi_ResetChaseState(&state);
+    for (i = 0; i < nCheckpoints * CHECKPOINT_INTERVAL; i++) {
+        const MIDIEvent *event = &list->events[i];
+        NativeMidi_ChaseEvent(&state, event, event->extraLen ? NativeMidi_GetExtraData(list, event) : NULL);
+        if ((i + 1) % CHECKPOINT_INTERVAL == 0) {
+            checkpoints[i / CHECKPOINT_INTERVAL] = state;
+        }
+    }
+    list->checkpoints = checkpoints;
+    list->nCheckpoints = nCheckpoints;
+    return true;
+}
+
+// Note down what players would otherwise have to search the events for:
+//  where the song ends, its tempo changes and time signatures, the size of
+//  its largest SysEx, and how every channel is set up along the way.
+static bool SummarizeEvents(MIDIEventList *list, Uint16 division)
+{
+    MIDITimeMap *map = &list->time;
+    MIDITempo *tempo = NULL;
+    MIDITimeSig *timeSig = NULL;
+    Uint32 nTempo = 0;
+    Uint32 nTimeSig = 0;
+    Uint32 i;
+
+    list->maxSysexLen = 0;
+    for (i = 0; i < list->nEvents; i++) {
+        const MIDIEvent *event = &list->events[i];
+        if (IsTempoEvent(event)) {
+            nTempo++;
+        } else if (IsTimeSigEvent(event)) {
+            nTimeSig++;
+        } else if (event->status == MIDI_SYSEX && event->extraLen > list->maxSysexLen) {
+            list->maxSysexLen = event->extraLen;
+        }
+    }
+
+    if (nTempo) {
+        tempo = (MIDITempo *) NativeMidi_ArenaAlloc(list->arena, sizeof(MIDITempo) * nTempo);
+    }
+    if (nTimeSig) {
+        timeSig = (MIDITimeSig *) NativeMidi_ArenaAlloc(list->arena, sizeof(MIDITimeSig) * nTimeSig);
+    }
+    if ((nTempo && !tempo) || (nTimeSig && !timeSig)) {
+        return false;
+    }
+
+    SDL_zerop(map);
+    map->division = division;
+    map->endTime = list->events[list->nEvents - 1].time;
+    map->tempo = tempo;
+    map->nTempo = nTempo;
+    map->timeSig = timeSig;
+    map->nTimeSig = nTimeSig;
+    for (i = 0; i < list->nEvents; i++) {
+        const MIDIEvent *event = &list->events[i];
+        if (IsTempoEvent(event)) {
+            ReadTempo(tempo++, event, NativeMidi_GetExtraData(list, event));
+        } else if (IsTimeSigEvent(event)) {
+            ReadTimeSig(timeSig++, event, NativeMidi_GetExtraData(list, event));
+        }
+    }
+    return IndexTimeMap(map, list->arena) && IndexCheckpoints(list);
+}
+
+// Create an empty list with room for nEvents events, in an arena of its own.
+//  events is set to NULL if that fails, and to the room for them otherwise.
+static MIDIEventList *CreateEventList(Uint32 nEvents, MIDIEvent **events)
+{
+    MIDIArena *arena;
+    MIDIEventList *list;
+
+    *events = NULL;
+    arena = NativeMidi_CreateArena(sizeof(MIDIEventList) + (sizeof(MIDIEvent) * nEvents));
+    if (NULL == arena) {
+        return NULL;
+    }
+    list = (MIDIEventList *) NativeMidi_ArenaAlloc(arena, sizeof(MIDIEventList));
+    if (NULL == list) {
+        NativeMidi_DestroyArena(arena);
+        return NULL;
+    }
+    list->arena = arena;
+    list->mapping = NULL;
+    SDL_SetAtomicInt(&list->refcount, 1);
+    list->nThinned = 0;
+    *events = (MIDIEvent *) NativeMidi_ArenaAlloc(arena, sizeof(MIDIEvent) * nEvents);
+    list->events = *events;
+    list->nEvents = nEvents;
+    if (NULL == *events) {
+        NativeMidi_DestroyArena(arena);
+        return NULL;
+    }
+    return list;
+}
+
+// The tracks being merged, kept in a binary min-heap ordered by the time of
+//  their next event. Ties go to the lower track number, so events that happen
+//  at the same time keep the order they have in the file.
+typedef struct
+{
+    const MIDIEvent *events;        // decoded events of all tracks
+    const Uint32 *trackEnd;         // one past the last event of each track
+    Uint32 *trackPos;               // next event of each track
+    int *heap;                      // track numbers
+    int heapLen;
+} MIDIMergeHeap;
+
+static SDL_INLINE bool TrackBefore(const MIDIMergeHeap *merge, int a, int b)
+{
+    const Uint32 timeA = merge->events[merge->trackPos[a]].time;
+    const Uint32 timeB = merge->events[merge->trackPos[b]].time;
+    return (timeA < timeB) || (timeA == timeB && a < b);
+}
+
+static void SiftDown(MIDIMergeHeap *merge, int i)
+{
+    int *heap = merge->heap;
+    const int track = heap[i];
+
+    while (1) {
+        int child = (2 * i) + 1;
+        if (child >= merge->heapLen) {
+            break;
+        }
+        if (child + 1 < merge->heapLen && TrackBefore(merge, heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!TrackBefore(merge, heap[child], track)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = track;
+}
+
+// Interweave the time-ordered events of all tracks into one time-ordered array
+static void MergeTracks(MIDIMergeHeap *merge, MIDIEvent *out, Uint32 nEvents)
+{
+    Uint32 i;
+    int h;
+
+    for (h = (merge->heapLen / 2) - 1; h >= 0; h--) {
+        SiftDown(merge, h);
+    }
+
+    for (i = 0; i < nEvents; i++) {
+        const int track = merge->heap[0];
+
+        out[i] = merge->events[merge->trackPos[track]++];
+
+        // Either the track moves down the heap, or it's exhausted and the
+        //  last entry takes its place.
+        if (merge->trackPos[track] == merge->trackEnd[track]) {
+            merge->heap[0] = merge->heap[--merge->heapLen];
+        }
+        if (merge->heapLen > 1) {
+            SiftDown(merge, 0);
+        }
+    }
+}
+
+// Thinning is off unless the SDL_NATIVE_MIDI_THIN hint is set. This function
+//  returns -1 if it's off, or how far continuous controllers may stray.
+static int GetThinTolerance(void)
+{
+    const char *hint;
+
+    if (!SDL_GetHintBoolean("SDL_NATIVE_MIDI_THIN", false)) {
+        return -1;
+    }
+    hint = SDL_GetHint("SDL_NATIVE_MIDI_THIN_TOLERANCE");
+    if (hint && *hint) {
+        return SDL_clamp(SDL_atoi(hint), 0, 127);
+    }
+    return 0;
+}
+
+// Controllers whose values sweep smoothly (modulation, volume, pan, expression,
+//  sound and effect controllers and the like), as opposed to bank selects,
+//  data entry and switches, where every value counts.
+static SDL_INLINE bool IsContinuousController(Uint8 controller)
+{
+    if (controller == 0 || controller == 6 || controller == 32 || controller == 38) {
+        return false;
+    }
+    return controller < 64 || (controller >= 70 && controller <= 95 && controller != 84);
+}
+
+// Controllers that trigger something every time they're sent
+static SDL_INLINE bool IsActionController(Uint8 controller)
+{
+    return controller == 6 || controller == 38 || controller == 96 || controller == 97 || controller >= 120;
+}
+
+typedef struct
+{
+    Uint32 onTime;      // time of the note-on that's sounding
+    bool sounding;
+    Uint8 doubled;      // note-ons dropped for doubling it, whose note-offs go too
+} MIDINoteState;
+
+/*
+ *  Drop the events of a song that change nothing: controller values, programs
+ *  and pitch bends a channel already has, and notes doubled at the same time
+ *  (along with their extra note-offs). With a tolerance, continuous controllers
+ *  and pitch bends that stay within it of the value last kept are dropped too,
+ *  as long as another one follows within a 128th note; the last of a run is
+ *  always kept, so values still settle where the song puts them. SysEx may
+ *  reset anything, so what is known about the channels is forgotten there.
+ *  The events are compacted in place; this function returns how many are left.
+ */
+static Uint32 ThinEvents(MIDIEvent *events, Uint32 nEvents, Uint16 division, int tolerance, MIDIArena *temp)
+{
+    MIDITimeMap map;
+    MIDIChaseState kept;
+    MIDINoteState *notes;
+    Uint32 *next;
+    Uint8 *dense;
+    Uint32 window;
+    Uint32 out = 0;
+    Uint32 i;
+    int k;
+
+    // The controllers and pitch bend (as controller 120) of every channel
+    next = (Uint32 *) NativeMidi_ArenaAlloc(temp, sizeof(Uint32) * MIDI_NUM_CHANNELS * 121);
+    notes = (MIDINoteState *) NativeMidi_ArenaAlloc(temp, sizeof(MIDINoteState) * MIDI_NUM_CHANNELS * 128);
+    dense = tolerance ? (Uint8 *) NativeMidi_ArenaAlloc(temp, nEvents) : NULL;
+    if (!next || !notes || (tolerance && !dense)) {
+        return nEvents;
+    }
+    SDL_memset(notes, 0, sizeof(MIDINoteState) * MIDI_NUM_CHANNELS * 128);
+
+    // Going backwards, note which continuous events are closely followed by another
+    if (tolerance) {
+        SDL_zero(map);
+        map.division = division;
+        window = SDL_max(TicksPerQuarter(&map) / 32, 1);
+        SDL_memset(next, 0xFF, sizeof(Uint32) * MIDI_NUM_CHANNELS * 121);
+        for (i = nEvents; i-- > 0;) {
+            const MIDIEvent *event = &events[i];
+            const Uint8 cmd = event->status >> 4;
+            Uint32 *slot;
+
+            dense[i] = false;
+            if (cmd == MIDI_STATUS_CONTROLLER && IsContinuousController(event->data[0])) {
+                slot = &next[((event->status & 0x0F) * 121) + event->data[0]];
+            } else if (cmd == MIDI_STATUS_PITCH_WHEEL) {
+                slot = &next[((event->status & 0x0F) * 121) + 120];
+            } else {
+                continue;
+            }
+            dense[i] = (*slot != SDL_MAX_UINT32 && *slot - event->time <= window);
+            *slot = event->time;
+        }
+    }
+
+    NativeMidi_ResetChaseState(&kept);
+    for (i = 0; i < nEvents; i++) {
+        const MIDIEvent *event = &events[i];
+        const Uint8 cmd = event->status >> 4;
+        MIDIChannelState *channel = &kept.channel[event->status & 0x0F];
+        MIDINoteState *note = &notes[((event->status & 0x0F) * 128) + (event->data[0] & 0x7F)];
+        bool drop = false;
+
+        // The last event stays, so the song doesn't get any shorter
+        if (i + 1 == nEvents) {
+            events[out++] = *event;
+            break;
+        }
+
+        switch (cmd) {
+            case MIDI_STATUS_NOTE_ON:
+                if (event->data[1] != 0) {
+                    if (note->sounding && note->onTime == event->time) {
+                        note->doubled++;
+                        drop = true;
+                    } else {
+                        note->onTime = event->time;
+                        note->sounding = true;
+                        note->doubled = 0;
+                    }
+                    break;
+                }
+                SDL_FALLTHROUGH;
+            case MIDI_STATUS_NOTE_OFF:
+                if (!note->sounding && note->doubled) {
+                    note->doubled--;
+                    drop = true;
+                } else {
+                    note->sounding = false;
+                }
+                break;
+            case MIDI_STATUS_CONTROLLER:
+                if (event->data[0] == 120 || event->data[0] >= 123) {
+                    // All sounds/notes off, and the mode changes that imply it
+                    for (k = 0; k < 128; k++) {
+                        notes[((event->status & 0x0F) * 128) + k].sounding = false;
+                    }
+                } else if (!IsActionController(event->data[0]) && channel->controller[event->data[0]] != MIDI_CHASE_UNSET) {
+                    const int diff = (int)event->data[1] - channel->controller[event->data[0]];
+                    drop = (diff == 0) || (tolerance && dense[i] && SDL_abs(diff) <= tolerance);
+                }
+                // A new bank makes the next program change count, even for the same program
+                if (!drop && (event->data[0] == 0 || event->data[0] == 32)) {
+                    channel->program = MIDI_CHASE_UNSET;
+                }
+                break;
+            case MIDI_STATUS_PROG_CHANGE:
+                drop = (channel->program == event->data[0]);
+                break;
+            case MIDI_STATUS_PITCH_WHEEL:
+                if (channel->bend[0] != MIDI_CHASE_UNSET) {
+                    const int diff = (((int)event->data[1] << 7) | event->data[0]) - (((int)channel->bend[1] << 7) | channel->bend[0]);
+                    drop = (diff == 0) || (tolerance && dense[i] && SDL_abs(diff) <= (tolerance << 7));
+                }
+                break;
+            case MIDI_STATUS_SYSEX:
+                if (event->status != MIDI_META_EVENT) {
+                    NativeMidi_ResetChaseState(&kept);
+                }
+                break;
+        }
+
+        if (!drop) {
+            if (cmd < MIDI_STATUS_SYSEX) {
+                NativeMidi_ChaseEvent(&kept, event, NULL);
+            }
+            events[out++] = *event;
+        }
+    }
+    return out;
+}
+
+/*
+ *  Convert a midi song, consisting of one or more tracks, to a list of MIDIEvents.
+ *  To do so, first count the events of every track so that the list can be
+ *  allocated in one go, then convert the tracks seperatly, then interweave the
+ *  resulting MIDIEvent arrays to one big array. A song with a single track
+ *  (which includes every format 0 file) is converted in place.
+ *  Everything that doesn't end up in the list is allocated from temp.
+ *  If inPlace is set, data outlives the list and the payload references it
+ *  instead of being copied. Unless thin is -1, the events are thinned out
+ *  with it as the tolerance (see ThinEvents) before the list is made.
+ */
+static MIDIEventList *MIDItoStream(MIDIFile *mididata, MIDIArena *temp, const Uint8 *data, size_t len, bool inPlace, int thin)
+{
+    MIDIEventList *list = NULL;
+    MIDIMergeHeap merge;
+    MIDIDecodeJob job;
+    MIDIEvent *events;
+    Uint32 *trackStart;
+    Uint32 nEvents = 0;
+    Uint32 nExtra = 0;
+    Uint32 payloadLen = 0;
+    const int nThreads = DecodeThreadCount(mididata);
+    int trackID;
+
+    trackStart = (Uint32 *) NativeMidi_ArenaAlloc(temp, (sizeof(Uint32) * 2 + sizeof(int)) * (mididata->nTracks + 1));
+    job.info = (MIDITrackInfo *) NativeMidi_ArenaAlloc(temp, sizeof(MIDITrackInfo) * mididata->nTracks);
+    if (NULL == trackStart || NULL == job.info) {
+        return NULL;
+    }
+    job.mididata = mididata;
+    job.base = data;
+    job.trackStart = trackStart;
+    job.events = NULL;
+
+    // First, count the events of all tracks
+    RunDecodeJob(&job, nThreads);
+    for (trackID = 0; trackID < mididata->nTracks; trackID++) {
+        trackStart[trackID] = nEvents;
+        nEvents += job.info[trackID].nEvents;
+        nExtra += job.info[trackID].nExtra;
+        payloadLen += job.info[trackID].payloadLen;
+    }
+    trackStart[mididata->nTracks] = nEvents;
+
+    if (nEvents == 0) {
+        SDL_SetError("MIDI file has no events");
+        return NULL;
+    }
+
+    // Songs that are thinned out are decoded into temp, so that their list
+    //  only takes up room for the events that are left
+    if (thin < 0) {
+        list = CreateEventList(nEvents, &events);
+    } else {
+        events = (MIDIEvent *) NativeMidi_ArenaAlloc(temp, sizeof(MIDIEvent) * nEvents);
+    }
+    if (NULL == events) {
+        return NULL;
+    }
+
+    // Nothing to merge? Then decode straight into the list.
+    if (mididata->nTracks == 1) {
+        MIDITracktoStream(&mididata->track[0], events, data);
+    } else {
+        job.events = (MIDIEvent *) NativeMidi_ArenaAlloc(temp, sizeof(MIDIEvent) * nEvents);
+        if (NULL == job.events) {
+            if (list) {
+                NativeMidi_DestroyArena(list->arena);
+            }
+            return NULL;
+        }
+
+        // Then, convert all tracks to MIDIEvent arrays
+        RunDecodeJob(&job, nThreads);
+
+        merge.events = job.events;
+        merge.trackEnd = trackStart + 1;
+        merge.trackPos = trackStart + mididata->nTracks + 1;
+        merge.heap = (int *) (merge.trackPos + mididata->nTracks + 1);
+        merge.heapLen = 0;
+        for (trackID = 0; trackID < mididata->nTracks; trackID++) {
+            merge.trackPos[trackID] = trackStart[trackID];
+            if (trackStart[trackID] != trackStart[trackID + 1]) {
+                merge.heap[merge.heapLen++] = trackID;
+            }
+        }
+
+        // Now, merge the arrays.
+        MergeTracks(&merge, events, nEvents);
+    }
+
+    if (thin >= 0) {
+        const Uint32 nKept = ThinEvents(events, nEvents, (Uint16)mididata->division, thin, temp);
+        MIDIEvent *kept;
+
+        list = CreateEventList(nKept, &kept);
+        if (NULL == kept) {
+            return NULL;
+        }
+        SDL_memcpy(kept, events, sizeof(MIDIEvent) * nKept);
+        list->nThinned = nEvents - nKept;
+        events = kept;
+    }
+
+    // Finally, either keep referencing the extra data in the file, or copy it
+    if (inPlace && nExtra) {
+        list->payload = data;
+        list->payloadLen = (Uint32)len;
+    } else if (!StorePayload(list, events, data, nExtra, payloadLen, temp)) {
+        NativeMidi_DestroyArena(list->arena);
+        return NULL;
+    }
+
+    if (!SummarizeEvents(list, (Uint16)mididata->division)) {
+        NativeMidi_DestroyArena(list->arena);
+        return NULL;
+    }
+
+    return list;
+}
+
+static SDL_INLINE Uint32 ReadU32BE(const Uint8 *data)
+{
+    return ((Uint32)data[0] << 24) | ((Uint32)data[1] << 16) | ((Uint32)data[2] << 8) | data[3];
+}
+
+static SDL_INLINE Uint16 ReadU16BE(const Uint8 *data)
+{
+    return (Uint16)((data[0] << 8) | data[1]);
+}
+
+static SDL_INLINE Uint32 ReadU32LE(const Uint8 *data)
+{
+    return ((Uint32)data[3] << 24) | ((Uint32)data[2] << 16) | ((Uint32)data[1] << 8) | data[0];
+}
+
+static SDL_INLINE Uint16 ReadU16LE(const Uint8 *data)
+{
+    return (Uint16)((data[1] << 8) | data[0]);
+}
+
+// Find the tracks of a midi file. They point into data, which must stay
+//  around while they are in use; only the track array comes from temp.
+static int ReadMIDIFile(MIDIFile *mididata, const Uint8 *data, size_t len, MIDIArena *temp)
+{
+    size_t pos = 0;
+    int i;
+    Uint32 ID = 0;
+    Uint32 size = 0;
+    Uint16 format = 0;
+    Uint16 tracks = 0;
+
+    if (!mididata) {
+        return 0;
+    }
+    if (!data) {
+        return 0;
+    }
+
+    // Make sure this is really a MIDI file
+    if (len < 4) {
+        return SDL_SetError("Not a MIDI file");
+    }
+    ID = ReadU32BE(data);
+    pos += 4;
+    if (ID == RIFF_MAGIC) {
+        pos += 16;
+        if (len < pos + 4) {
+            return SDL_SetError("Not a MIDI file");
+        }
+        ID = ReadU32BE(data + pos);
+        pos += 4;
+    }
+    if (ID != MIDI_MAGIC) {
+        return SDL_SetError("Not a MIDI file");
+    }
+
+    // Header size must be 6
+    if (len < pos + 4 + 6) {
+        return SDL_SetError("MIDI file header is truncated");
+    }
+    size = ReadU32BE(data + pos);
+    pos += 4;
+    if (size != 6) {
+        return SDL_SetError("MIDI file header has a size of %" SDL_PRIu32 ", not 6", size);
+    }
+
+    // We only support format 0 and 1, but not 2
+    format = ReadU16BE(data + pos);
+    if (format != 0 && format != 1) {
+        return SDL_SetError("MIDI file format %d isn't supported", (int)format);
+    }
+
+    tracks = ReadU16BE(data + pos + 2);
+    mididata->nTracks = tracks;
+
+    // Retrieve the PPQN value, needed for playback
+    mididata->division = ReadU16BE(data + pos + 4);
+    pos += 6;
+
+    // Allocate tracks
+    mididata->track = (MIDITrack*) NativeMidi_ArenaAlloc(temp, sizeof(MIDITrack) * mididata->nTracks);
+    if (NULL == mididata->track) {
+        return 0;
+    }
+
+    for (i = 0; i < tracks; i++) {
+        if (len < pos + 8) {
+            return SDL_SetError("MIDI file is truncated at track %d of %d", i + 1, (int)tracks);
+        }
+        size = ReadU32BE(data + pos + 4);
+        pos += 8;
+        if (size > len - pos || size > SDL_MAX_SINT32) {
+            return SDL_SetError("MIDI file is truncated at track %d of %d", i + 1, (int)tracks);
+        }
+        mididata->track[i].len = (int)size;
+        mididata->track[i].data = data + pos;
+        pos += size;
+    }
+    return 1;
+}
+
+// The bytes of a midi file, wherever they came from
+typedef struct
+{
+    const Uint8 *data;
+    size_t len;
+    bool borrowed;                  // data is the memory of a memory stream...
+    bool inPlace;                   // ...which is known to outlive the song
+    MIDIMapping *mapping;           // the mapped file that memory belongs to
+    void *loaded;                   // to be freed with SDL_free
+} MIDIFileData;
+
+// Get at the bytes of a midi file. Memory streams (which includes mapped
+//  files) are used right where they are. Their data can even stay there,
+//  if the memory outlives the song: mapped files can be kept alive, and for
+//  anything else the application has to promise so with a hint.
+//  Other streams are read into arena with a single call, or loaded in one
+//  piece if their size is unknown.
+static bool GetMIDIFileData(SDL_IOStream *src, MIDIArena *arena, MIDIFileData *file)
+{
+    SDL_PropertiesID props = SDL_GetIOProperties(src);
+    const Uint8 *mem = (const Uint8 *) SDL_GetPointerProperty(props, SDL_PROP_IOSTREAM_MEMORY_POINTER, NULL);
+
+    SDL_zerop(file);
+    if (mem) {
+        const Sint64 size = SDL_GetNumberProperty(props, SDL_PROP_IOSTREAM_MEMORY_SIZE_NUMBER, 0);
+        const Sint64 pos = SDL_TellIO(src);
+        if (pos >= 0 && pos <= size) {
+            file->data = mem + pos;
+            file->len = (size_t)(size - pos);
+        }
+        file->borrowed = true;
+        file->mapping = (MIDIMapping *) SDL_GetPointerProperty(props, MIDI_PROP_MAPPING, NULL);
+        file->inPlace = (file->mapping || SDL_GetHintBoolean("SDL_NATIVE_MIDI_ZERO_COPY", false));
+    } else {
+        const Sint64 size = SDL_GetIOSize(src);
+        const Sint64 pos = SDL_TellIO(src);
+        if (size >= 0 && pos >= 0 && pos <= size) {
+            Uint8 *buf = (Uint8 *) NativeMidi_ArenaAlloc(arena, (size_t)(size - pos));
+            if (buf) {
+                file->len = SDL_ReadIO(src, buf, (size_t)(size - pos));
+                file->data = buf;
+            }
+        } else {
+            file->loaded = SDL_LoadFile_IO(src, &file->len, false);
+            file->data = (const Uint8 *) file->loaded;
+        }
+    }
+
+    if (!file->data) {
+        return false;
+    }
+
+    // Extra data is referenced by 32-bit offsets into the file
+    if (file->len > SDL_MAX_UINT32) {
+        return SDL_SetError("MIDI file is too big");
+    }
+    return true;
+}
+
+/*
+ *  Precompiled songs are a MIDIEventList written out as is: a header, the
+ *  tempo changes, the time signatures, the events and the payload, one after
+ *  the other. Everything
+ *  is little-endian and aligned for its contents, and the events have the
+ *  layout of MIDIEvent, so on little-endian hosts a mapped song is used right
+ *  where it is. Elsewhere, it's converted while being copied.
+ *
+ *  Header:
+ *     0  magic                 'NMID'
+ *     4  version               Uint16
+ *     6  division              Uint16
+ *     8  number of events      Uint32
+ *    12  end time              Uint32
+ *    16  number of tempos      Uint32
+ *    20  longest SysEx         Uint32
+ *    24  payload length        Uint32
+ *    28  number of time sigs.  Uint32
+ *  Tempo:  time Uint32, tempo Uint32
+ *  Time signature: time Uint32, numerator Uint8, denominator Uint8, clocks Uint8, notated 32nds Uint8
+ *  Event:  time Uint32, status Uint8, data Uint8[2], 0, extraLen Uint32, extraOffset Uint32
+ */
+#define COMPILED_MAGIC          0x44494D4E // 'NMID', as read little-endian
+#define COMPILED_VERSION        2
+#define COMPILED_HEADER_SIZE    32
+#define COMPILED_TEMPO_SIZE     8
+#define COMPILED_TIMESIG_SIZE   8
+#define COMPILED_EVENT_SIZE     16
+
+SDL_COMPILE_TIME_ASSERT(compiled_tempo, sizeof(MIDITempo) == COMPILED_TEMPO_SIZE);
+SDL_COMPILE_TIME_ASSERT(compiled_timesig, sizeof(MIDITimeSig) == COMPILED_TIMESIG_SIZE);
+SDL_COMPILE_TIME_ASSERT(compiled_event, sizeof(MIDIEvent) == COMPILED_EVENT_SIZE);
+SDL_COMPILE_TIME_ASSERT(compiled_event_status, offsetof(MIDIEvent, status) == 4);
+SDL_COMPILE_TIME_ASSERT(compiled_event_extra, offsetof(MIDIEvent, extraLen) == 8 && offsetof(MIDIEvent, extraOffset) == 12);
+
+static bool IsCompiledSong(const Uint8 *data, size_t len)
+{
+    return len >= COMPILED_HEADER_SIZE && ReadU32LE(data) == COMPILED_MAGIC;
+}
+
+// Load a precompiled song. Its events, time map and payload are used in
+//  place when file says the data outlives the song and the layout matches;
+//  only the index of the time map is built anew. Nothing in the file is
+//  trusted, so every event is checked either way.
+static MIDIEventList *ReadCompiledSong(const MIDIFileData *file, Uint16 *division)
+{
+    const Uint8 *data = file->data;
+    MIDIArena *arena;
+    MIDIEventList *list;
+    Uint32 nEvents, nTempo, nTimeSig, payloadLen;
+    size_t timeSigPos, eventPos, payloadPos;
+    bool direct;
+    Uint32 i;
+
+    if (ReadU16LE(data + 4) != COMPILED_VERSION) {
+        SDL_SetError("Precompiled song version %d isn't supported", (int)ReadU16LE(data + 4));
+        return NULL;
+    }
+    nEvents = ReadU32LE(data + 8);
+    nTempo = ReadU32LE(data + 16);
+    payloadLen = ReadU32LE(data + 24);
+    nTimeSig = ReadU32LE(data + 28);
+
+    // Each part has to fit into what's left of the file after the ones before,
+    //  which also keeps the offsets from overflowing where size_t is 32 bits
+    if (nEvents == 0 || nTempo > (file->len - COMPILED_HEADER_SIZE) / COMPILED_TEMPO_SIZE) {
+        SDL_SetError("Precompiled song is corrupt");
+        return NULL;
+    }
+    timeSigPos = COMPILED_HEADER_SIZE + ((size_t)nTempo * COMPILED_TEMPO_SIZE);
+    if (nTimeSig > (file->len - timeSigPos) / COMPILED_TIMESIG_SIZE) {
+        SDL_SetError("Precompiled song is corrupt");
+        return NULL;
+    }
+    eventPos = timeSigPos + ((size_t)nTimeSig * COMPILED_TIMESIG_SIZE);
+    if (nEvents > (file->len - eventPos) / COMPILED_EVENT_SIZE) {
+        SDL_SetError("Precompiled song is corrupt");
+        return NULL;
+    }
+    payloadPos = eventPos + ((size_t)nEvents * COMPILED_EVENT_SIZE);
+    if (payloadLen > file->len - payloadPos) {
+        SDL_SetError("Precompiled song is corrupt");
+        return NULL;
+    }
+
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+    direct = file->inPlace && (((uintptr_t)data) & 3) == 0;
+#else
+    direct = false;
+#endif
+
+    arena = NativeMidi_CreateArena(sizeof(MIDIEventList) + (direct ? 0 : (payloadPos - COMPILED_HEADER_SIZE) + payloadLen));
+    if (NULL == arena) {
+        return NULL;
+    }
+    list = (MIDIEventList *) NativeMidi_ArenaAlloc(arena, sizeof(MIDIEventList));
+    if (NULL == list) {
+        NativeMidi_DestroyArena(arena);
+        return NULL;
+    }
+    list->arena = arena;
+    list->mapping = NULL;
+    SDL_SetAtomicInt(&list->refcount, 1);
+    list->nEvents = nEvents;
+    list->nThinned = 0;
+    list->payloadLen = payloadLen;
+    list->maxSysexLen = ReadU32LE(data + 20);
+    SDL_zero(list->time);
+    list->time.division = ReadU16LE(data + 6);
+    list->time.endTime = ReadU32LE(data + 12);
+    list->time.nTempo = nTempo;
+    list->time.nTimeSig = nTimeSig;
+
+    if (direct) {
+        list->events = (const MIDIEvent *) (data + eventPos);
+        list->time.tempo = (const MIDITempo *) (data + COMPILED_HEADER_SIZE);
+        list->time.timeSig = (const MIDITimeSig *) (data + timeSigPos);
+        list->payload = data + payloadPos;
+    } else {
+        MIDIEvent *events = (MIDIEvent *) NativeMidi_ArenaAlloc(arena, sizeof(MIDIEvent) * nEvents);
+        MIDITempo *tempo = (MIDITempo *) NativeMidi_ArenaAlloc(arena, sizeof(MIDITempo) * nTempo);
+        MIDITimeSig *timeSig = (MIDITimeSig *) NativeMidi_ArenaAlloc(arena, sizeof(MIDITimeSig) * nTimeSig);
+        Uint8 *payload = (Uint8 *) NativeMidi_ArenaAlloc(arena, payloadLen);
+        if (NULL == events || NULL == tempo || NULL == timeSig || NULL == payload) {
+            NativeMidi_DestroyArena(arena);
+            return NULL;
+        }
+        for (i = 0; i < nTempo; i++) {
+            const Uint8 *in = data + COMPILED_HEADER_SIZE + (i * COMPILED_TEMPO_SIZE);
+            tempo[i].time = ReadU32LE(in);
+            tempo[i].tempo = ReadU32LE(in + 4);
+        }
+        for (i = 0; i < nTimeSig; i++) {
+            const Uint8 *in = data + timeSigPos + ((size_t)i * COMPILED_TIMESIG_SIZE);
+            timeSig[i].time = ReadU32LE(in);
+            timeSig[i].numerator = in[4];
+            timeSig[i].denominator = in[5];
+            timeSig[i].clocks = in[6];
+            timeSig[i].notated32nds = in[7];
+        }
+        for (i = 0; i < nEvents; i++) {
+            const Uint8 *in = data + eventPos + ((size_t)i * COMPILED_EVENT_SIZE);
+            events[i].time = ReadU32LE(in);
+            events[i].status = in[4];
+            events[i].data[0] = in[5];
+            events[i].data[1] = in[6];
+            events[i].extraLen = ReadU32LE(in + 8);
+            events[i].extraOffset = ReadU32LE(in + 12);
+        }
+        SDL_memcpy(payload, data + payloadPos, payloadLen);
+        list->events = events;
+        list->time.tempo = tempo;
+        list->time.timeSig = timeSig;
+        list->payload = payload;
+    }
+
+    // Everything below reads extra data where events say it is, so check that
+    //  first, along with the events being well formed MIDI, which compacting
+    //  them relies on. Players also rely on the largest SysEx fitting the
+    //  buffers sized after the header, and seeking on the events being in order
+    for (i = 0; i < nEvents; i++) {
+        const MIDIEvent *event = &list->events[i];
+        if (event->status < 0x80 ||
+            (event->status < 0xF0 && ((event->data[0] | event->data[1]) & 0x80)) ||
+            event->extraLen > payloadLen || event->extraOffset > payloadLen - event->extraLen ||
+            (event->status == MIDI_SYSEX && event->extraLen > list->maxSysexLen) ||
+            (i > 0 && event->time < list->events[i - 1].time)) {
+            SDL_SetError("Precompiled song is corrupt");
+            NativeMidi_DestroyArena(arena);
+            return NULL;
+        }
+    }
+
+    // Conversions rely on the time map being in order
+    for (i = 1; i < nTempo; i++) {
+        if (list->time.tempo[i].time < list->time.tempo[i - 1].time) {
+            SDL_SetError("Precompiled song is corrupt");
+            NativeMidi_DestroyArena(arena);
+            return NULL;
+        }
+    }
+    for (i = 1; i < nTimeSig; i++) {
+        if (list->time.timeSig[i].time < list->time.timeSig[i - 1].time) {
+            SDL_SetError("Precompiled song is corrupt");
+            NativeMidi_DestroyArena(arena);
+            return NULL;
+        }
+    }
+    if (!IndexTimeMap(&list->time, arena) || !IndexCheckpoints(list)) {
+        NativeMidi_DestroyArena(arena);
+        return NULL;
+    }
+
+    if (direct && file->mapping) {
+        SDL_AtomicIncRef(&file->mapping->refcount);
+        list->mapping = file->mapping;
+    }
+    if (division) {
+        *division = ReadU16LE(data + 6);
+    }
+    return list;
+}
+
+// Write a list as a precompiled song; see ReadCompiledSong
+static bool WriteCompiledSong(const MIDIEventList *list, Uint16 division, SDL_IOStream *dst)
+{
+    Uint8 buf[COMPILED_EVENT_SIZE * 256];
+    size_t len = 0;
+    Uint32 i;
+
+    if (!SDL_WriteU32LE(dst, COMPILED_MAGIC) || !SDL_WriteU16LE(dst, COMPILED_VERSION) ||
+        !SDL_WriteU16LE(dst, division) || !SDL_WriteU32LE(dst, list->nEvents) ||
+        !SDL_WriteU32LE(dst, list->time.endTime) || !SDL_WriteU32LE(dst, list->time.nTempo) ||
+        !SDL_WriteU32LE(dst, list->maxSysexLen) || !SDL_WriteU32LE(dst, list->payloadLen) ||
+        !SDL_WriteU32LE(dst, list->time.nTimeSig)) {
+        return false;
+    }
+
+    for (i = 0; i < list->time.nTempo; i++) {
+        if (!SDL_WriteU32LE(dst, list->time.tempo[i].time) || !SDL_WriteU32LE(dst, list->time.tempo[i].tempo)) {
+            return false;
+        }
+    }
+    for (i = 0; i < list->time.nTimeSig; i++) {
+        const MIDITimeSig *timeSig = &list->time.timeSig[i];
+        if (!SDL_WriteU32LE(dst, timeSig->time) || !SDL_WriteU8(dst, timeSig->numerator) ||
+            !SDL_WriteU8(dst, timeSig->denominator) || !SDL_WriteU8(dst, timeSig->clocks) ||
+            !SDL_WriteU8(dst, timeSig->notated32nds)) {
+            return false;
+        }
+    }
+
+    // Events are converted in batches, as there are lots of them
+    for (i = 0; i < list->nEvents; i++) {
+        const MIDIEvent *event = &list->events[i];
+        Uint8 *out = buf + len;
+        out[0] = (Uint8)event->time;
+        out[1] = (Uint8)(event->time >> 8);
+        out[2] = (Uint8)(event->time >> 16);
+        out[3] = (Uint8)(event->time >> 24);
+        out[4] = event->status;
+        out[5] = event->data[0];
+        out[6] = event->data[1];
+        out[7] = 0;
+        out[8] = (Uint8)event->extraLen;
+        out[9] = (Uint8)(event->extraLen >> 8);
+        out[10] = (Uint8)(event->extraLen >> 16);
+        out[11] = (Uint8)(event->extraLen >> 24);
+        out[12] = (Uint8)event->extraOffset;
+        out[13] = (Uint8)(event->extraOffset >> 8);
+        out[14] = (Uint8)(event->extraOffset >> 16);
+        out[15] = (Uint8)(event->extraOffset >> 24);
+        len += COMPILED_EVENT_SIZE;
+        if (len == sizeof(buf) || i + 1 == list->nEvents) {
+            if (SDL_WriteIO(dst, buf, len) != len) {
+                return false;
+            }
+            len = 0;
+        }
+    }
+
+    return SDL_WriteIO(dst, list->payload, list->payloadLen) == list->payloadLen;
+}
+
+// Songs decoded before, handed out again when the same data is loaded.
+//  Entries are found by a hash of the file data, and a copy of the data
+//  kept with the list confirms the match, so a collision can't hand out the
+//  wrong song. That's compared outside the lock, as it can take a while for
+//  big songs. They are kept in least recently used order, so the oldest go
+//  first once the budget is exceeded.
+typedef struct MIDICacheEntry
+{
+    struct MIDICacheEntry *prev;    // more recently used
+    struct MIDICacheEntry *next;    // less recently used
+    Uint64 hash;
+    size_t len;                     // length of the file data
+    int thin;                       // thinning tolerance, -1 if not thinned
+    Uint16 division;
+    MIDIEventList *list;            // the cache's own reference
+    size_t size;                    // memory taken up by the list, including the copy of the data
+    const Uint8 *data;              // copy of the file data, in the list's arena
+} MIDICacheEntry;
+
+static SDL_SpinLock cacheLock;
+static MIDICacheEntry *cacheHead;
+static MIDICacheEntry *cacheTail;
+static NativeMidi_CacheStats cacheStats;
+
+// The cache is off unless it's given a budget with the SDL_NATIVE_MIDI_CACHE_SIZE hint
+static size_t GetCacheBudget(void)
+{
+    const char *hint = SDL_GetHint("SDL_NATIVE_MIDI_CACHE_SIZE");
+    return (hint && *hint) ? (size_t)SDL_strtoull(hint, NULL, 0) : 0;
+}
+
+static Uint64 HashMIDIFileData(const Uint8 *data, size_t len)
+{
+    return ((Uint64)SDL_murmur3_32(data, len, 0) << 32) | SDL_murmur3_32(data, len, 0x9747b28c);
+}
+
+static void UnlinkCacheEntry(MIDICacheEntry *entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        cacheHead = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        cacheTail = entry->prev;
+    }
+}
+
+static void PushCacheEntry(MIDICacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cacheHead;
+    if (cacheHead) {
+        cacheHead->prev = entry;
+    } else {
+        cacheTail = entry;
+    }
+    cacheHead = entry;
+}
+
+// Find a cached list by its hash; the caller gets a reference of its own,
+//  which keeps the copy of the data alive to be compared once the lock is
+//  released. Call with cacheLock held.
+static MIDIEventList *FindCachedList(Uint64 hash, size_t len, int thin, const Uint8 **data, Uint16 *division)
+{
+    MIDICacheEntry *entry;
+
+    for (entry = cacheHead; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->len == len && entry->thin == thin) {
+            UnlinkCacheEntry(entry);
+            PushCacheEntry(entry);
+            SDL_AtomicIncRef(&entry->list->refcount);
+            *data = entry->data;
+            if (division) {
+                *division = entry->division;
+            }
+            return entry->list;
+        }
+    }
+    return NULL;
+}
+
+// Find a cached list for this very data, with a reference for the caller
+static MIDIEventList *LookUpCachedList(Uint64 hash, const Uint8 *data, size_t len, int thin, Uint16 *division)
+{
+    MIDIEventList *list;
+    const Uint8 *cached = NULL;
+
+    SDL_LockSpinlock(&cacheLock);
+    list = FindCachedList(hash, len, thin, &cached, division);
+    SDL_UnlockSpinlock(&cacheLock);
+
+    if (list && SDL_memcmp(cached, data, len) != 0) {
+        NativeMidi_FreeMIDIEventList(list);
+        list = NULL;
+    }
+    return list;
+}
+
+// Drop least recently used entries until the cache fits the budget.
+//  Call with cacheLock held; the dropped entries are returned for the
+//  caller to free once the lock is released.
+static MIDICacheEntry *TrimCache(size_t budget)
+{
+    MIDICacheEntry *dropped = NULL;
+
+    while (cacheTail && cacheStats.bytes > budget) {
+        MIDICacheEntry *entry = cacheTail;
+        UnlinkCacheEntry(entry);
+        cacheStats.bytes -= entry->size;
+        cacheStats.songs--;
+        entry->next = dropped;
+        dropped = entry;
+    }
+    return dropped;
+}
+
+static void FreeCacheEntries(MIDICacheEntry *entry)
+{
+    while (entry) {
+        MIDICacheEntry *next = entry->next;
+        NativeMidi_FreeMIDIEventList(entry->list);
+        NativeMidi_free(entry);
+        entry = next;
+    }
+}
+
+// Add a freshly decoded list to the cache. Returns the list to use, which
+//  is a cached one if another thread added the same song in the meantime.
+static MIDIEventList *AddCachedList(Uint64 hash, const Uint8 *data, size_t len, int thin, Uint16 division, MIDIEventList *list, size_t budget)
+{
+    MIDICacheEntry *entry;
+    MIDICacheEntry *dropped;
+    MIDIEventList *cached;
+    Uint8 *copy;
+
+    if (ArenaSize(list->arena) + len > budget) {
+        return list;
+    }
+    cached = LookUpCachedList(hash, data, len, thin, NULL);
+    if (cached) {
+        NativeMidi_FreeMIDIEventList(list);
+        return cached;
+    }
+
+    // The list isn't shared yet, so its arena can still take the copy
+    entry = (MIDICacheEntry *) NativeMidi_malloc(sizeof(MIDICacheEntry));
+    copy = (Uint8 *) NativeMidi_ArenaAlloc(list->arena, len);
+    if (!entry || !copy) {
+        NativeMidi_free(entry);
+        return list;
+    }
+    SDL_memcpy(copy, data, len);
+    entry->data = copy;
+    entry->hash = hash;
+    entry->len = len;
+    entry->thin = thin;
+    entry->division = division;
+    entry->list = list;
+    entry->size = ArenaSize(list->arena);
+
+    SDL_LockSpinlock(&cacheLock);
+    SDL_AtomicIncRef(&list->refcount);
+    PushCacheEntry(entry);
+    cacheStats.bytes += entry->size;
+    cacheStats.songs++;
+    dropped = TrimCache(budget);
+    for (entry = dropped; entry; entry = entry->next) {
+        cacheStats.evictions++;
+    }
+    SDL_UnlockSpinlock(&cacheLock);
+
+    FreeCacheEntries(dropped);
+    return list;
+}
+
+MIDIEventList *NativeMidi_CreateMIDIEventList(SDL_IOStream *src, Uint16 *division)
+{
+    MIDIArena *temp;
+    MIDIFile *mididata;
+    MIDIEventList *eventList = NULL;
+    MIDIFileData file;
+    const size_t budget = GetCacheBudget();
+    const int thin = GetThinTolerance();
+    bool cacheable = false;
+    Uint64 hash = 0;
+    Uint16 div = 0;
+
+    if (src == NULL) {
+        return NULL;
+    }
+
+    // All the bookkeeping needed to decode the file goes away in one go
+    temp = NativeMidi_CreateArena(ARENA_BLOCK_SIZE);
+    if (!temp) {
+        return NULL;
+    }
+
+    mididata = (MIDIFile *) NativeMidi_ArenaAlloc(temp, sizeof(MIDIFile));
+    if (!GetMIDIFileData(src, temp, &file) || !mididata) {
+        SDL_free(file.loaded);
+        NativeMidi_DestroyArena(temp);
+        return NULL;
+    }
+
+    // Cached lists can outlive the song, so they must not borrow memory
+    //  that only the song is promised to be outlived by
+    if (budget && (!file.inPlace || file.mapping)) {
+        cacheable = true;
+        hash = HashMIDIFileData(file.data, file.len);
+        eventList = LookUpCachedList(hash, file.data, file.len, thin, &div);
+        SDL_LockSpinlock(&cacheLock);
+        if (eventList) {
+            cacheStats.hits++;
+        } else {
+            cacheStats.misses++;
+        }
+        SDL_UnlockSpinlock(&cacheLock);
+    }
+
+    if (eventList) {
+        // Cache hit, nothing to decode
+        cacheable = false;
+    } else if (IsCompiledSong(file.data, file.len)) {
+        eventList = ReadCompiledSong(&file, &div);
+    } else {
+        SDL_zerop(mididata);
+
+        // Read in the data
+        if (ReadMIDIFile(mididata, file.data, file.len, temp)) {
+            div = (Uint16)mididata->division;
+            eventList = MIDItoStream(mididata, temp, file.data, file.len, file.inPlace, thin);
+        }
+
+        // If the payload points into a mapped file, keep the mapping around
+        if (eventList && file.mapping && eventList->payload == file.data) {
+            SDL_AtomicIncRef(&file.mapping->refcount);
+            eventList->mapping = file.mapping;
+        }
+    }
+
+    if (eventList && cacheable) {
+        eventList = AddCachedList(hash, file.data, file.len, thin, div, eventList, budget);
+    }
+    if (eventList && division) {
+        *division = div;
+    }
+
+    SDL_free(file.loaded);
+    NativeMidi_DestroyArena(temp);
+    return eventList;
+}
+
+Uint32 NativeMidi_SeekMIDIEventList(const MIDIEventList *list, Uint32 time, MIDIChaseState *state)
+{
+    Uint32 lo = 0;
+    Uint32 hi = list->nEvents;
+    Uint32 checkpoint;
+    Uint32 i;
+
+    while (lo < hi) {
+        const Uint32 mid = lo + ((hi - lo) / 2);
+        if (list->events[mid].time < time) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    checkpoint = SDL_min(lo / CHECKPOINT_INTERVAL, list->nCheckpoints);
+    if (checkpoint) {
+        *state = list->checkpoints[checkpoint - 1];
+    } else {
+        NativeMidi_ResetChaseState(state);
+    }
+    for (i = checkpoint * CHECKPOINT_INTERVAL; i < lo; i++) {
+        const MIDIEvent *event = &list->events[i];
+        NativeMidi_ChaseEvent(state, event, event->extraLen ? NativeMidi_GetExtraData(list, event) : NULL);
+    }
+    return lo;
+}
+
+void NativeMidi_FreeMIDIEventList(MIDIEventList *list)
+{
+    // The list lives in its own arena, along with everything else of the song
+    if (list && SDL_AtomicDecRef(&list->refcount)) {
+        ReleaseMapping(list->mapping);
+        NativeMidi_DestroyArena(list->arena);
+    }
+}
+
+// A stream holds on to the file data and decodes one event per track ahead.
+//  The tracks are kept in the same heap MergeTracks uses, except that every
+//  track only ever has a single pending event, the one in next[], so the
+//  position of every track is simply its own number.
+/*
+ *  Compact songs are a list packed the way midifiles pack a track: every event
+ *  is a variable length delta time, a status byte unless it's the same as the
+ *  one before (running status) and the data bytes. SysEx and meta events
+ *  follow up with the length and offset of their extra data, which stays in a
+ *  payload buffer like that of a list. That's three or four bytes for most
+ *  events instead of sizeof(MIDIEvent), while the checkpoints of the list are
+ *  kept for seeking, along with where they are in the packed data.
+ */
+typedef struct
+{
+    Uint32 offset;      // where the first event after the checkpoint starts
+    Uint32 time;        // time of the last event before it
+    Uint8 running;      // running status there
+} MIDICompactMark;
+
+struct MIDIEventStream
+{
+    MIDIArena *arena;               // Owns the stream and, unless borrowed, the file data
+    MIDIMapping *mapping;           // Keeps a mapped file alive
+    MIDIEventList *list;            // A precompiled song, played as is...
+    Uint32 pos;                     // ...from this event on
+    MIDIFile file;
+    MIDITrackCursor *cursors;       // decoding state of every track
+    MIDIEvent *next;                // pending event of every track
+    const Uint8 **extra;            // extra data of the pending events
+    MIDIMergeHeap merge;
+    MIDITimeMap *timeMap;           // scanned for when first needed...
+    SDL_InitState timeMapInit;      // ...by one thread, the others wait for it
+
+    const Uint8 *packed;            // A compact song (see below), decoded as it's played
+    Uint32 packedLen;
+    Uint32 packedPos;               // where the event after current starts
+    Uint8 running;                  // running status
+    bool packedEnd;                 // no current event
+    MIDIEvent current;
+    const Uint8 *payload;           // extra data of its events
+    Uint32 payloadLen;
+    Uint32 nEvents;
+    Uint32 nThinned;
+    const MIDIChaseState *checkpoints; // chase state every CHECKPOINT_INTERVAL events...
+    const MIDICompactMark *marks;   // ...and where in packed that is
+    Uint32 nCheckpoints;
+};
+
+// Bytes of data that follow the status of channel messages
+static const Uint8 compactDataLen[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 1, 1, 2, 0 };
+
+// Read a variable length quantity from a compact song, which is known to be intact
+static SDL_INLINE Uint32 ReadPackedVLQ(const Uint8 **p)
+{
+    Uint32 value = 0;
+    Uint8 c;
+
+    do {
+        c = *(*p)++;
+        value = (value << 7) | (c & 0x7F);
+    } while (c & 0x80);
+    return value;
+}
+
+// Decode the event of a compact song at packedPos into current
+static void DecodePackedEvent(MIDIEventStream *stream)
+{
+    const Uint8 *p = stream->packed + stream->packedPos;
+    MIDIEvent *event = &stream->current;
+    Uint8 status;
+
+    if (stream->packedPos >= stream->packedLen) {
+        stream->packedEnd = true;
+        return;
+    }
+
+    event->time += ReadPackedVLQ(&p);
+    status = *p;
+    if (status & 0x80) {
+        stream->running = status;
+        p++;
+    }
+    status = stream->running;
+    event->status = status;
+
+    if (status < 0xF0) {
+        // The buffer is padded, so reading one data byte too many is fine
+        const Uint8 len = compactDataLen[status >> 4];
+        event->data[0] = p[0];
+        event->data[1] = (len == 2) ? p[1] : 0;
+        event->extraLen = 0;
+        event->extraOffset = 0;
+        p += len;
+    } else {
+        event->data[0] = (status == MIDI_META_EVENT) ? *p++ : 0;
+        event->data[1] = 0;
+        event->extraLen = ReadPackedVLQ(&p);
+        event->extraOffset = event->extraLen ? ReadPackedVLQ(&p) : 0;
+    }
+    stream->packedPos = (Uint32)(p - stream->packed);
+}
+
+MIDIEventStream *NativeMidi_CreateMIDIEventStream(SDL_IOStream *src, Uint16 *division)
+{
+    MIDIArena *arena;
+    MIDIEventStream *stream;
+    MIDIFileData file;
+    const Uint8 *data;
+    int nTracks;
+    int trackID;
+
+    if (src == NULL) {
+        return NULL;
+    }
+
+    arena = NativeMidi_CreateArena(sizeof(MIDIEventStream));
+    if (!arena) {
+        return NULL;
+    }
+    stream = (MIDIEventStream *) NativeMidi_ArenaAlloc(arena, sizeof(MIDIEventStream));
+    if (!GetMIDIFileData(src, arena, &file) || !stream) {
+        SDL_free(file.loaded);
+        NativeMidi_DestroyArena(arena);
+        return NULL;
+    }
+    SDL_zerop(stream);
+    stream->arena = arena;
+
+    // The file data has to stay around for as long as the stream does
+    data = file.data;
+    if ((file.borrowed && !file.inPlace) || file.loaded) {
+        Uint8 *copy = (Uint8 *) NativeMidi_ArenaAlloc(arena, file.len);
+        if (copy) {
+            SDL_memcpy(copy, file.data, file.len);
+        }
+        data = copy;
+        SDL_free(file.loaded);
+    }
+    if (!data) {
+        NativeMidi_DestroyArena(arena);
+        return NULL;
+    }
+    if (file.inPlace && file.mapping) {
+        SDL_AtomicIncRef(&file.mapping->refcount);
+        stream->mapping = file.mapping;
+    }
+
+    // Precompiled songs need no decoding; they're played from their list,
+    //  which can use the data the stream holds on to right where it is
+    if (IsCompiledSong(data, file.len)) {
+        file.data = data;
+        file.inPlace = true;
+        file.mapping = NULL;
+        stream->list = ReadCompiledSong(&file, division);
+        if (!stream->list) {
+            NativeMidi_FreeMIDIEventStream(stream);
+            return NULL;
+        }
+        return stream;
+    }
+
+    if (!ReadMIDIFile(&stream->file, data, file.len, arena)) {
+        NativeMidi_FreeMIDIEventStream(stream);
+        return NULL;
+    }
+
+    nTracks = stream->file.nTracks;
+    stream->cursors = (MIDITrackCursor *) NativeMidi_ArenaAlloc(arena, sizeof(MIDITrackCursor) * nTracks);
+    stream->next = (MIDIEvent *) NativeMidi_ArenaAlloc(arena, sizeof(MIDIEvent) * nTracks);
+    stream->extra = (const Uint8 **) NativeMidi_ArenaAlloc(arena, sizeof(const Uint8 *) * nTracks);
+    stream->merge.trackPos = (Uint32 *) NativeMidi_ArenaAlloc(arena, sizeof(Uint32) * nTracks);
+    stream->merge.heap = (int *) NativeMidi_ArenaAlloc(arena, sizeof(int) * nTracks);
+    if (!stream->cursors || !stream->next || !stream->extra || !stream->merge.trackPos || !stream->merge.heap) {
+        NativeMidi_FreeMIDIEventStream(stream);
+        return NULL;
+    }
+    stream->merge.events = stream->next;
+    for (trackID = 0; trackID < nTracks; trackID++) {
+        stream->merge.trackPos[trackID] = (Uint32)trackID;
+    }
+
+    NativeMidi_RewindMIDIEventStream(stream);
+    if (!NativeMidi_PeekMIDIEventStream(stream, NULL)) {
+        NativeMidi_FreeMIDIEventStream(stream);
+        return NULL;
+    }
+
+    if (division) {
+        *division = stream->file.division;
+    }
+    return stream;
+}
+
+// Write a variable length quantity to out, unless it's NULL, and return its length
+static Uint32 PutPackedVLQ(Uint8 *out, Uint32 value)
+{
+    Uint32 len = 1;
+    Uint32 i;
+
+    while (len < 5 && (value >> (7 * len))) {
+        len++;
+    }
+    if (out) {
+        for (i = 0; i < len; i++) {
+            out[i] = (Uint8)((value >> (7 * (len - 1 - i))) & 0x7F) | ((i + 1 < len) ? 0x80 : 0);
+        }
+    }
+    return len;
+}
+
+// Pack the events of a list, or just count the bytes if out is NULL. The
+//  marks of the list's checkpoints are filled in if marks isn't NULL.
+static size_t PackEvents(const MIDIEventList *list, Uint8 *out, MIDICompactMark *marks)
+{
+    size_t len = 0;
+    Uint32 time = 0;
+    Uint8 running = 0;
+    Uint32 i;
+
+    for (i = 0; i < list->nEvents; i++) {
+        const MIDIEvent *event = &list->events[i];
+
+        if (marks && i && (i % CHECKPOINT_INTERVAL) == 0 && (i / CHECKPOINT_INTERVAL) <= list->nCheckpoints) {
+            MIDICompactMark *mark = &marks[(i / CHECKPOINT_INTERVAL) - 1];
+            mark->offset = (Uint32)len;
+            mark->time = time;
+            mark->running = running;
+        }
+
+        len += PutPackedVLQ(out ? out + len : NULL, event->time - time);
+        time = event->time;
+        if (event->status != running || event->status >= 0xF0 || (event->data[0] & 0x80)) {
+            if (out) {
+                out[len] = event->status;
+            }
+            len++;
+            running = event->status;
+        }
+
+        if (event->status < 0xF0) {
+            if (out) {
+                out[len] = event->data[0];
+                out[len + 1] = event->data[1];
+            }
+            len += compactDataLen[event->status >> 4];
+        } else {
+            if (event->status == MIDI_META_EVENT) {
+                if (out) {
+                    out[len] = event->data[0];
+                }
+                len++;
+            }
+            len += PutPackedVLQ(out ? out + len : NULL, event->extraLen);
+            if (event->extraLen) {
+                len += PutPackedVLQ(out ? out + len : NULL, event->extraOffset);
+            }
+        }
+    }
+
+    // A checkpoint right at the end of the song
+    if (marks && list->nEvents == list->nCheckpoints * CHECKPOINT_INTERVAL && list->nCheckpoints) {
+        MIDICompactMark *mark = &marks[list->nCheckpoints - 1];
+        mark->offset = (Uint32)len;
+        mark->time = time;
+        mark->running = running;
+    }
+    return len;
+}
+
+MIDIEventStream *NativeMidi_CompactMIDIEventList(const MIDIEventList *list)
+{
+    // Extra data that isn't the list's own (a mapped file, or memory the
+    //  song is promised to be outlived by) can stay where it is
+    const bool borrowPayload = (list->payloadLen == 0 || list->mapping || !ArenaContains(list->arena, list->payload));
+    const size_t packedLen = PackEvents(list, NULL, NULL);
+    const size_t checkpointsLen = sizeof(MIDIChaseState) * list->nCheckpoints;
+    const size_t marksLen = sizeof(MIDICompactMark) * list->nCheckpoints;
+    MIDIArena *arena;
+    MIDIEventStream *stream;
+    Uint8 *packed;
+
+    if (packedLen >= SDL_MAX_UINT32) {
+        SDL_SetError("Song too big to be compacted");
+        return NULL;
+    }
+
+    // Everything fits in the first block, so a compact song is one allocation
+    arena = NativeMidi_CreateArena(ARENA_ROUND(sizeof(MIDIEventStream)) + ARENA_ROUND(packedLen + 1) +
+                                   ARENA_ROUND(checkpointsLen) + ARENA_ROUND(marksLen) +
+                                   GetTimeMapCopySize(&list->time) + (borrowPayload ? 0 : ARENA_ROUND(list->payloadLen)));
+    if (!arena) {
+        return NULL;
+    }
+    stream = (MIDIEventStream *) NativeMidi_ArenaAlloc(arena, sizeof(MIDIEventStream));
+    packed = (Uint8 *) NativeMidi_ArenaAlloc(arena, packedLen + 1);
+    SDL_zerop(stream);
+    stream->arena = arena;
+
+    packed[packedLen] = 0;
+    if (list->nCheckpoints) {
+        MIDICompactMark *marks = (MIDICompactMark *) NativeMidi_ArenaAlloc(arena, marksLen);
+        stream->checkpoints = (const MIDIChaseState *) SDL_memcpy(NativeMidi_ArenaAlloc(arena, checkpointsLen), list->checkpoints, checkpointsLen);
+        stream->marks = marks;
+        stream->nCheckpoints = list->nCheckpoints;
+        PackEvents(list, packed, marks);
+    } else {
+        PackEvents(list, packed, NULL);
+    }
+    stream->packed = packed;
+    stream->packedLen = (Uint32)packedLen;
+    stream->nEvents = list->nEvents;
+    stream->nThinned = list->nThinned;
+    stream->timeMap = CopyTimeMapTo(&list->time, NativeMidi_ArenaAlloc(arena, GetTimeMapCopySize(&list->time)));
+
+    if (borrowPayload) {
+        stream->payload = list->payload;
+        if (list->mapping) {
+            SDL_AtomicIncRef(&list->mapping->refcount);
+            stream->mapping = list->mapping;
+        }
+    } else {
+        stream->payload = (const Uint8 *) SDL_memcpy(NativeMidi_ArenaAlloc(arena, list->payloadLen), list->payload, list->payloadLen);
+    }
+    stream->payloadLen = list->payloadLen;
+
+    NativeMidi_RewindMIDIEventStream(stream);
+    return stream;
+}
+
+const MIDIEvent *NativeMidi_PeekMIDIEventStream(const MIDIEventStream *stream, const Uint8 **extra)
+{
+    int track;
+
+    if (stream->packed) {
+        if (stream->packedEnd) {
+            return NULL;
+        }
+        if (extra) {
+            *extra = stream->current.extraLen ? stream->payload + stream->current.extraOffset : NULL;
+        }
+        return &stream->current;
+    }
+
+    if (stream->list) {
+        const MIDIEvent *event;
+        if (stream->pos == stream->list->nEvents) {
+            return NULL;
+        }
+        event = &stream->list->events[stream->pos];
+        if (extra) {
+            *extra = NativeMidi_GetExtraData(stream->list, event);
+        }
+        return event;
+    }
+
+    if (stream->merge.heapLen == 0) {
+        return NULL;
+    }
+    track = stream->merge.heap[0];
+    if (extra) {
+        *extra = stream->extra[track];
+    }
+    return &stream->next[track];
+}
+
+void NativeMidi_AdvanceMIDIEventStream(MIDIEventStream *stream)
+{
+    MIDIMergeHeap *merge = &stream->merge;
+    int track;
+
+    if (stream->list) {
+        if (stream->pos < stream->list->nEvents) {
+            stream->pos++;
+        }
+        return;
+    } else if (stream->packed) {
+        if (!stream->packedEnd) {
+            DecodePackedEvent(stream);
+        }
+        return;
+    }
+
+    if (merge->heapLen == 0) {
+        return;
+    }
+
+    // Either the track gets its next event and moves down the heap, or it's
+    //  exhausted and the last entry takes its place.
+    track = merge->heap[0];
+    if (!NextTrackEvent(&stream->cursors[track], &stream->next[track], &stream->extra[track])) {
+        merge->heap[0] = merge->heap[--merge->heapLen];
+    }
+    if (merge->heapLen > 1) {
+        SiftDown(merge, 0);
+    }
+}
+
+void NativeMidi_RewindMIDIEventStream(MIDIEventStream *stream)
+{
+    MIDIMergeHeap *merge = &stream->merge;
+    int trackID;
+    int h;
+
+    stream->pos = 0;
+    if (stream->packed) {
+        stream->packedPos = 0;
+        stream->running = 0;
+        stream->packedEnd = false;
+        stream->current.time = 0;
+        DecodePackedEvent(stream);
+        return;
+    }
+
+    merge->heapLen = 0;
+    for (trackID = 0; trackID < stream->file.nTracks; trackID++) {
+        MIDITrackCursor *cursor = &stream->cursors[trackID];
+        SDL_zerop(cursor);
+        cursor->track = &stream->file.track[trackID];
+        if (NextTrackEvent(cursor, &stream->next[trackID], &stream->extra[trackID])) {
+            merge->heap[merge->heapLen++] = trackID;
+        }
+    }
+    for (h = (merge->heapLen / 2) - 1; h >= 0; h--) {
+        SiftDown(merge, h);
+    }
+}
+
+void NativeMidi_SeekMIDIEventStream(MIDIEventStream *stream, Uint32 time, MIDIChaseState *state)
+{
+    const MIDIEvent *event;
+    const Uint8 *extra;
+
+    if (stream->list) {
+        stream->pos = NativeMidi_SeekMIDIEventList(stream->list, time, state);
+        return;
+    }
+
+    NativeMidi_ResetChaseState(state);
+    NativeMidi_RewindMIDIEventStream(stream);
+
+    // Compact songs go on from the last checkpoint before time
+    if (stream->packed && stream->nCheckpoints && stream->marks[0].time < time) {
+        Uint32 lo = 1;
+        Uint32 hi = stream->nCheckpoints;
+        const MIDICompactMark *mark;
+        while (lo < hi) {
+            const Uint32 mid = lo + ((hi - lo) / 2);
+            if (stream->marks[mid].time < time) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        mark = &stream->marks[lo - 1];
+        *state = stream->checkpoints[lo - 1];
+        stream->packedPos = mark->offset;
+        stream->running = mark->running;
+        stream->current.time = mark->time;
+        DecodePackedEvent(stream);
+    }
+    while ((event = NativeMidi_PeekMIDIEventStream(stream, &extra)) != NULL && event->time < time) {
+        NativeMidi_ChaseEvent(state, event, extra);
+        NativeMidi_AdvanceMIDIEventStream(stream);
+    }
+}
+
+// A tempo change or time signature found while scanning a stream, along
+//  with where it was found so sorting keeps the order of the file
+typedef struct
+{
+    Uint32 seq;
+    bool isTempo;
+    union {
+        MIDITempo tempo;
+        MIDITimeSig timeSig;
+    } u;
+} MIDITimeEvent;
+
+static int SDLCALL CompareTimeEvents(const void *a, const void *b)
+{
+    const MIDITimeEvent *eventA = (const MIDITimeEvent *) a;
+    const MIDITimeEvent *eventB = (const MIDITimeEvent *) b;
+    const Uint32 timeA = eventA->isTempo ? eventA->u.tempo.time : eventA->u.timeSig.time;
+    const Uint32 timeB = eventB->isTempo ? eventB->u.tempo.time : eventB->u.timeSig.time;
+
+    if (timeA != timeB) {
+        return (timeA < timeB) ? -1 : 1;
+    }
+    return (eventA->seq < eventB->seq) ? -1 : (eventA->seq > eventB->seq);
+}
+
+// Build the time map of a midifile, track by track. This leaves the stream's
+//  cursors alone, as the stream may be playing meanwhile.
+static MIDITimeMap *ScanTimeMap(MIDIEventStream *stream)
+{
+    MIDITimeEvent *found = NULL;
+    Uint32 nFound = 0;
+    Uint32 maxFound = 0;
+    bool sorted = true;
+    MIDITimeMap *map;
+    MIDITempo *tempo;
+    MIDITimeSig *timeSig;
+    Uint32 i;
+    int trackID;
+
+    map = (MIDITimeMap *) NativeMidi_ArenaAlloc(stream->arena, sizeof(MIDITimeMap));
+    if (!map) {
+        return NULL;
+    }
+    SDL_zerop(map);
+    map->division = (Uint16)stream->file.division;
+
+    for (trackID = 0; trackID < stream->file.nTracks; trackID++) {
+        MIDITrackCursor cursor;
+        MIDIEvent event;
+        const Uint8 *extra;
+
+        SDL_zero(cursor);
+        cursor.track = &stream->file.track[trackID];
+        while (NextTrackEvent(&cursor, &event, &extra)) {
+            MIDITimeEvent *timeEvent;
+            map->endTime = SDL_max(map->endTime, event.time);
+            if (!IsTempoEvent(&event) && !IsTimeSigEvent(&event)) {
+                continue;
+            }
+            if (nFound == maxFound) {
+                void *grown = NativeMidi_realloc(found, sizeof(MIDITimeEvent) * (maxFound ? maxFound * 2 : 16));
+                if (!grown) {
+                    NativeMidi_free(found);
+                    return NULL;
+                }
+                found = (MIDITimeEvent *) grown;
+                maxFound = maxFound ? maxFound * 2 : 16;
+            }
+            timeEvent = &found[nFound];
+            timeEvent->seq = nFound;
+            timeEvent->isTempo = IsTempoEvent(&event);
+            if (timeEvent->isTempo) {
+                ReadTempo(&timeEvent->u.tempo, &event, extra);
+                map->nTempo++;
+            } else {
+                ReadTimeSig(&timeEvent->u.timeSig, &event, extra);
+                map->nTimeSig++;
+            }
+            if (nFound && CompareTimeEvents(&found[nFound - 1], timeEvent) > 0) {
+                sorted = false;
+            }
+            nFound++;
+        }
+    }
+
+    // Usually, all of them are in the first track and already in order
+    if (!sorted) {
+        SDL_qsort(found, nFound, sizeof(MIDITimeEvent), CompareTimeEvents);
+    }
+
+    tempo = (MIDITempo *) NativeMidi_ArenaAlloc(stream->arena, sizeof(MIDITempo) * map->nTempo);
+    timeSig = (MIDITimeSig *) NativeMidi_ArenaAlloc(stream->arena, sizeof(MIDITimeSig) * map->nTimeSig);
+    if (!tempo || !timeSig) {
+        NativeMidi_free(found);
+        return NULL;
+    }
+    map->tempo = tempo;
+    map->timeSig = timeSig;
+    for (i = 0; i < nFound; i++) {
+        if (found[i].isTempo) {
+            *tempo++ = found[i].u.tempo;
+        } else {
+            *timeSig++ = found[i].u.timeSig;
+        }
+    }
+    NativeMidi_free(found);
+
+    return IndexTimeMap(map, stream->arena) ? map : NULL;
+}
+
+const MIDITimeMap *NativeMidi_GetMIDIEventStreamTimeMap(MIDIEventStream *stream)
+{
+    const MIDITimeMap *map;
+
+    if (stream->list) {
+        return &stream->list->time;
+    }
+
+    // Only callers wanting this very stream's map wait while the file is scanned
+    if (SDL_ShouldInit(&stream->timeMapInit)) {
+        if (!stream->timeMap) {
+            stream->timeMap = ScanTimeMap(stream);
+        }
+        SDL_SetInitialized(&stream->timeMapInit, stream->timeMap != NULL);
+    }
+    map = stream->timeMap;
+
+    if (!map) {
+        SDL_OutOfMemory();
+    }
+    return map;
+}
+
+void NativeMidi_FreeMIDIEventStream(MIDIEventStream *stream)
+{
+    if (stream) {
+        NativeMidi_FreeMIDIEventList(stream->list);
+        ReleaseMapping(stream->mapping);
+        NativeMidi_DestroyArena(stream->arena);
+    }
+}
+
+static void SDLCALL CleanupMappingProperty(void *userdata, void *value)
+{
+    (void)userdata;
+    ReleaseMapping((MIDIMapping *) value);
+}
+
+// Wrap the data of a whole file in a memory stream, which takes it over. The
+//  stream holds a reference to the data, and so will any list decoded from it.
+//  The data is released with the last reference, or right away on failure.
+static SDL_IOStream *WrapMIDIFileData(void *data, size_t len, bool mapped)
+{
+    MIDIMapping *mapping;
+    SDL_IOStream *io;
+
+    mapping = (MIDIMapping *) NativeMidi_malloc(sizeof(MIDIMapping));
+    if (!mapping) {
+#ifdef MIDI_HAVE_MMAP
+        if (mapped) {
+            munmap(data, len);
+        } else
+#endif
+        {
+            SDL_free(data);
+        }
+        return NULL;
+    }
+    mapping->data = data;
+    mapping->len = len;
+    mapping->mapped = mapped;
+    SDL_SetAtomicInt(&mapping->refcount, 1);
+
+    io = SDL_IOFromConstMem(data, len);
+    if (!io) {
+        ReleaseMapping(mapping);
+        return NULL;
+    }
+
+    // On failure, this calls the cleanup function, releasing the mapping
+    if (!SDL_SetPointerPropertyWithCleanup(SDL_GetIOProperties(io), MIDI_PROP_MAPPING, mapping, CleanupMappingProperty, NULL)) {
+        SDL_CloseIO(io);
+        return NULL;
+    }
+    return io;
+}
+
+#ifdef MIDI_HAVE_MMAP
+// Map a whole file and wrap it in a memory stream
+static SDL_IOStream *MapMIDIFile(const char *path)
+{
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    return WrapMIDIFileData(data, (size_t)st.st_size, true);
+}
+#endif
+
+NativeMidi_Song *NativeMidi_LoadSong(const char *path)
+{
+    SDL_IOStream *io = NULL;
+#ifdef MIDI_HAVE_MMAP
+    io = MapMIDIFile(path);
+#endif
+    if (!io) {
+        io = SDL_IOFromFile(path, "rb");
+    }
+    return io ? NativeMidi_LoadSong_IO(io, true) : NULL;
+}
+
+#define MAX_LOAD_THREADS    16
+
+// Songs being loaded together. Every thread grabs the next path until there
+//  are none left. Errors are per thread, so the first one is kept here for
+//  the caller.
+typedef struct
+{
+    const char * const *paths;
+    NativeMidi_Song **songs;
+    int count;
+    SDL_AtomicInt next;
+    SDL_SpinLock lock;
+    int failed;                     // number of songs that didn't load
+    const char *failedPath;         // the first of them...
+    char error[256];                // ...and why
+} MIDILoadJob;
+
+static int SDLCALL LoadSongsThread(void *data)
+{
+    MIDILoadJob *job = (MIDILoadJob *) data;
+    int i;
+
+    while ((i = SDL_AddAtomicInt(&job->next, 1)) < job->count) {
+        job->songs[i] = job->paths[i] ? NativeMidi_LoadSong(job->paths[i]) : NULL;
+        if (!job->songs[i]) {
+            SDL_LockSpinlock(&job->lock);
+            if (job->failed++ == 0) {
+                job->failedPath = job->paths[i];
+                SDL_strlcpy(job->error, job->paths[i] ? SDL_GetError() : "Parameter 'path' is invalid", sizeof(job->error));
+            }
+            SDL_UnlockSpinlock(&job->lock);
+        }
+    }
+    return 0;
+}
+
+bool NativeMidi_LoadSongs(const char * const *paths, int count, NativeMidi_Song **songs)
+{
+    SDL_Thread *threads[MAX_LOAD_THREADS];
+    MIDILoadJob job;
+    int nThreads;
+    int started = 0;
+    int i;
+
+    if (!paths) {
+        return SDL_InvalidParamError("paths");
+    } else if (!songs) {
+        return SDL_InvalidParamError("songs");
+    } else if (count <= 0) {
+        return true;
+    }
+
+    SDL_zero(job);
+    job.paths = paths;
+    job.songs = songs;
+    job.count = count;
+
+    // The calling thread loads songs as well. If threads can't be created,
+    //  whoever is running picks up the slack.
+    nThreads = SDL_clamp(SDL_min(SDL_GetNumLogicalCPUCores(), count), 1, MAX_LOAD_THREADS);
+    for (i = 1; i < nThreads; i++) {
+        threads[started] = SDL_CreateThread(LoadSongsThread, "SDL_MIDI_load", &job);
+        if (threads[started]) {
+            started++;
+        }
+    }
+    LoadSongsThread(&job);
+    for (i = 0; i < started; i++) {
+        SDL_WaitThread(threads[i], NULL);
+    }
+
+    if (job.failed) {
+        if (job.failed == 1) {
+            return SDL_SetError("Couldn't load '%s': %s", job.failedPath ? job.failedPath : "(null)", job.error);
+        }
+        return SDL_SetError("Couldn't load %d songs, including '%s': %s", job.failed, job.failedPath ? job.failedPath : "(null)", job.error);
+    }
+    return true;
+}
+
+// A song being loaded in the background: the file is read with SDL's async
+//  I/O, and a thread of its own waits for that and decodes the song.
+struct NativeMidi_AsyncLoad
+{
+    SDL_AsyncIOQueue *queue;
+    SDL_Thread *thread;
+    SDL_AtomicInt done;
+    NativeMidi_Song *song;
+    char *path;
+    char error[256];                // why the song didn't load
+};
+
+static void LoadSongAsyncResult(NativeMidi_AsyncLoad *load)
+{
+    SDL_AsyncIOOutcome outcome;
+    SDL_IOStream *io;
+
+    if (!SDL_WaitAsyncIOResult(load->queue, &outcome, -1)) {
+        SDL_snprintf(load->error, sizeof(load->error), "Couldn't read '%s': %s", load->path, SDL_GetError());
+    } else if (outcome.result != SDL_ASYNCIO_COMPLETE) {
+        SDL_free(outcome.buffer);
+        SDL_snprintf(load->error, sizeof(load->error), "Couldn't read '%s'", load->path);
+    } else if (!(io = WrapMIDIFileData(outcome.buffer, (size_t)outcome.bytes_transferred, false)) ||
+               !(load->song = NativeMidi_LoadSong_IO(io, true))) {
+        SDL_snprintf(load->error, sizeof(load->error), "Couldn't load '%s': %s", load->path, SDL_GetError());
+    }
+    SDL_SetAtomicInt(&load->done, 1);
+}
+
+static int SDLCALL LoadSongAsyncThread(void *data)
+{
+    LoadSongAsyncResult((NativeMidi_AsyncLoad *) data);
+    return 0;
+}
+
+NativeMidi_AsyncLoad *NativeMidi_LoadSongAsync(const char *path)
+{
+    NativeMidi_AsyncLoad *load;
+
+    if (!path) {
+        SDL_InvalidParamError("path");
+        return NULL;
+    }
+
+    load = (NativeMidi_AsyncLoad *) SDL_calloc(1, sizeof(*load));
+    if (!load) {
+        return NULL;
+    }
+    load->path = SDL_strdup(path);
+    load->queue = SDL_CreateAsyncIOQueue();
+    if (!load->path || !load->queue || !SDL_LoadFileAsync(path, load->queue, load)) {
+        if (load->queue) {
+            SDL_DestroyAsyncIOQueue(load->queue);
+        }
+        SDL_free(load->path);
+        SDL_free(load);
+        return NULL;
+    }
+
+    // Without a thread, the caller has to wait after all
+    load->thread = SDL_CreateThread(LoadSongAsyncThread, "SDL_MIDI_async", load);
+    if (!load->thread) {
+        LoadSongAsyncResult(load);
+    }
+    return load;
+}
+
+bool NativeMidi_IsAsyncLoadDone(NativeMidi_AsyncLoad *load)
+{
+    if (!load) {
+        return SDL_InvalidParamError("load");
+    }
+    return SDL_GetAtomicInt(&load->done) != 0;
+}
+
+NativeMidi_Song *NativeMidi_FinishAsyncLoad(NativeMidi_AsyncLoad *load)
+{
+    NativeMidi_Song *song;
+
+    if (!load) {
+        SDL_InvalidParamError("load");
+        return NULL;
+    }
+
+    if (load->thread) {
+        SDL_WaitThread(load->thread, NULL);
+    }
+    song = load->song;
+    if (!song) {
+        SDL_SetError("%s", load->error);
+    }
+    SDL_DestroyAsyncIOQueue(load->queue);
+    SDL_free(load->path);
+    SDL_free(load);
+    return song;
+}
+
+bool NativeMidi_CompileSong_IO(SDL_IOStream *src, bool closesrc, SDL_IOStream *dst, bool closedst)
+{
+    MIDIEventList *list = NULL;
+    Uint16 division = 0;
+    bool result = false;
+
+    if (!src) {
+        SDL_InvalidParamError("src");
+    } else if (!dst) {
+        SDL_InvalidParamError("dst");
+    } else if ((list = NativeMidi_CreateMIDIEventList(src, &division)) != NULL) {
+        // Otherwise, the error is whatever went wrong decoding the song
+        result = WriteCompiledSong(list, division, dst);
+    }
+
+    NativeMidi_FreeMIDIEventList(list);
+    if (src && closesrc) {
+        SDL_CloseIO(src);
+    }
+    if (dst && closedst && !SDL_CloseIO(dst)) {
+        result = false;
+    }
+    return result;
+}
+
+bool NativeMidi_CompileSong(const char *srcpath, const char *dstpath)
+{
+    SDL_IOStream *src;
+    SDL_IOStream *dst;
+
+    if (!(src = SDL_IOFromFile(srcpath, "rb"))) {
+        return false;
+    }
+    if (!(dst = SDL_IOFromFile(dstpath, "wb"))) {
+        SDL_CloseIO(src);
+        return false;
+    }
+    return NativeMidi_CompileSong_IO(src, true, dst, true);
+}
+
+void NativeMidi_GetCacheStats(NativeMidi_CacheStats *stats)
+{
+    if (!stats) {
+        return;
+    }
+    SDL_LockSpinlock(&cacheLock);
+    *stats = cacheStats;
+    SDL_UnlockSpinlock(&cacheLock);
+}
+
+void NativeMidi_ClearCache(void)
+{
+    MIDICacheEntry *dropped;
+
+    SDL_LockSpinlock(&cacheLock);
+    dropped = TrimCache(0);
+    SDL_UnlockSpinlock(&cacheLock);
+
+    FreeCacheEntries(dropped);
+}
+
+void NativeMidi_AddMIDIEventListStats(const MIDIEventList *list, NativeMidi_SongStats *stats)
+{
+    stats->events += list->nEvents;
+    stats->thinned_events += list->nThinned;
+    stats->payload_bytes += list->payloadLen;
+    AddArenaStats(list->arena, stats);
+    if (list->mapping) {
+        AddMappingStats(list->mapping, stats);
+    }
+    if (SDL_GetAtomicInt((SDL_AtomicInt *)&list->refcount) > 1) {
+        stats->shared = true;
+    }
+}
+
+void NativeMidi_AddMIDIEventStreamStats(const MIDIEventStream *stream, NativeMidi_SongStats *stats)
+{
+    if (stream->list) {
+        NativeMidi_AddMIDIEventListStats(stream->list, stats);
+    }
+    if (stream->packed) {
+        stats->events += stream->nEvents;
+        stats->thinned_events += stream->nThinned;
+        stats->payload_bytes += stream->payloadLen;
+    }
+    AddArenaStats(stream->arena, stats);
+    if (stream->mapping) {
+        AddMappingStats(stream->mapping, stats);
+    }
+}
+
+MIDITimeMap *NativeMidi_CopyTimeMap(const MIDITimeMap *map)
+{
+    void *mem = NativeMidi_malloc(GetTimeMapCopySize(map));
+    return mem ? CopyTimeMapTo(map, mem) : NULL;
+}
+
+// The last tempo change at or before a time, -1 if there is none
+static int FindTempo(const MIDITimeMap *map, Uint32 ticks)
+{
+    Uint32 lo = 0;
+    Uint32 hi = map->nTempo;
+
+    while (lo < hi) {
+        const Uint32 mid = lo + ((hi - lo) / 2);
+        if (map->tempo[mid].time <= ticks) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (int)lo - 1;
+}
+
+// The last tempo change starting at or before a microsecond, -1 if there is none
+static int FindTempoStart(const MIDITimeMap *map, Uint64 us)
+{
+    Uint32 lo = 0;
+    Uint32 hi = map->nTempo;
+
+    while (lo < hi) {
+        const Uint32 mid = lo + ((hi - lo) / 2);
+        if (map->tempoStart[mid] <= us) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (int)lo - 1;
+}
+
+// The last time signature at or before a time, -1 if there is none
+static int FindTimeSig(const MIDITimeMap *map, Uint32 ticks)
+{
+    Uint32 lo = 0;
+    Uint32 hi = map->nTimeSig;
+
+    while (lo < hi) {
+        const Uint32 mid = lo + ((hi - lo) / 2);
+        if (map->timeSig[mid].time <= ticks) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (int)lo - 1;
+}
+
+// The last time signature starting at or before a bar, -1 if there is none
+static int FindTimeSigBar(const MIDITimeMap *map, Uint32 bar)
+{
+    Uint32 lo = 0;
+    Uint32 hi = map->nTimeSig;
+
+    while (lo < hi) {
+        const Uint32 mid = lo + ((hi - lo) / 2);
+        if (map->timeSigBar[mid] <= bar) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (int)lo - 1;
+}
+
+Uint64 NativeMidi_MapTicksToMicroseconds(const MIDITimeMap *map, Uint32 ticks)
+{
+    const int i = FindTempo(map, ticks);
+
+    if (i < 0) {
+        return TicksToMicroseconds(map, ticks, DEFAULT_TEMPO);
+    }
+    return map->tempoStart[i] + TicksToMicroseconds(map, ticks - map->tempo[i].time, map->tempo[i].tempo);
+}
+
+Uint32 NativeMidi_MapMicrosecondsToTicks(const MIDITimeMap *map, Uint64 us)
+{
+    const int i = FindTempoStart(map, us);
+    Uint64 ticks;
+
+    if (i < 0) {
+        return (Uint32)MicrosecondsToTicks(map, us, DEFAULT_TEMPO);
+    }
+    ticks = (Uint64)map->tempo[i].time + MicrosecondsToTicks(map, us - map->tempoStart[i], map->tempo[i].tempo);
+    return (Uint32)SDL_min(ticks, SDL_MAX_UINT32);
+}
+
+static const MIDITimeMap *GetTimeMap(NativeMidi_Song *song)
+{
+    if (!song) {
+        SDL_InvalidParamError("song");
+        return NULL;
+    }
+    return NativeMidi_GetSongTimeMap(song);
+}
+
+Sint64 NativeMidi_GetSongLength(NativeMidi_Song *song)
+{
+    const MIDITimeMap *map = GetTimeMap(song);
+    return map ? (Sint64)NativeMidi_MapTicksToMicroseconds(map, map->endTime) : -1;
+}
+
+Sint64 NativeMidi_GetSongLengthTicks(NativeMidi_Song *song)
+{
+    const MIDITimeMap *map = GetTimeMap(song);
+    return map ? (Sint64)map->endTime : -1;
+}
+
+Sint64 NativeMidi_TicksToMicroseconds(NativeMidi_Song *song, Uint32 ticks)
+{
+    const MIDITimeMap *map = GetTimeMap(song);
+    return map ? (Sint64)NativeMidi_MapTicksToMicroseconds(map, ticks) : -1;
+}
+
+Sint64 NativeMidi_MicrosecondsToTicks(NativeMidi_Song *song, Uint64 us)
+{
+    const MIDITimeMap *map = GetTimeMap(song);
+    return map ? (Sint64)NativeMidi_MapMicrosecondsToTicks(map, us) : -1;
+}
+
+bool NativeMidi_TicksToBarBeat(NativeMidi_Song *song, Uint32 ticks, NativeMidi_BarBeat *pos)
+{
+    const MIDITimeMap *map = GetTimeMap(song);
+    Uint32 beatTicks, barTicks, start, bar, rest;
+    int i;
+
+    if (!map) {
+        return false;
+    } else if (!pos) {
+        return SDL_InvalidParamError("pos");
+    }
+
+    i = FindTimeSig(map, ticks);
+    GetBarLength(map, i < 0 ? NULL : &map->timeSig[i], &beatTicks, &barTicks);
+    start = (i < 0) ? 0 : map->timeSig[i].time;
+    bar = (i < 0) ? 0 : map->timeSigBar[i];
+    rest = (ticks - start) % barTicks;
+    pos->bar = bar + ((ticks - start) / barTicks);
+    pos->beat = rest / beatTicks;
+    pos->tick = rest % beatTicks;
+    return true;
+}
+
+Sint64 NativeMidi_BarBeatToTicks(NativeMidi_Song *song, const NativeMidi_BarBeat *pos)
+{
+    const MIDITimeMap *map = GetTimeMap(song);
+    Uint32 beatTicks, barTicks;
+    Uint64 ticks;
+    int i;
+
+    if (!map) {
+        return -1;
+    } else if (!pos) {
+        SDL_InvalidParamError("pos");
+        return -1;
+    }
+
+    i = FindTimeSigBar(map, pos->bar);
+    GetBarLength(map, i < 0 ? NULL : &map->timeSig[i], &beatTicks, &barTicks);
+    ticks = (i < 0) ? 0 : map->timeSig[i].time;
+    ticks += (Uint64)(pos->bar - ((i < 0) ? 0 : map->timeSigBar[i])) * barTicks;
+    ticks += ((Uint64)pos->beat * beatTicks) + pos->tick;
+    return (Sint64)SDL_min(ticks, SDL_MAX_UINT32);
+}
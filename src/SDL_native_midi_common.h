@@ -34,9 +34,35 @@
 #define MIDI_STATUS_PITCH_WHEEL 0xE
 #define MIDI_STATUS_SYSEX       0xF
 
-// We store the midi events in a linked list; this way it is
-//  easy to shuffle the tracks together later on; and we are
-//  flexible in the size of each elemnt.
+// Allocation functions for everything songs own. They behave like their SDL
+//  counterparts, but keep the counts NativeMidi_GetMemoryStats reports.
+//  Memory from them must be released with NativeMidi_free.
+extern void *NativeMidi_malloc(size_t size);
+extern void *NativeMidi_calloc(size_t nmemb, size_t size);
+extern void *NativeMidi_realloc(void *mem, size_t size);
+extern void NativeMidi_free(void *mem);
+
+// Get the size memory from NativeMidi_malloc and friends was allocated with.
+extern size_t NativeMidi_GetAllocSize(const void *mem);
+
+// A growable arena. Memory is handed out from a chain of blocks and is
+//  only ever released all at once, so a whole song costs a few allocations
+//  and a single call to free.
+typedef struct MIDIArena MIDIArena;
+
+// Create an arena whose first block can hold at least initialSize bytes.
+extern MIDIArena *NativeMidi_CreateArena(size_t initialSize);
+
+// Allocate memory from an arena, suitably aligned for any of our structs.
+//  The memory is not zeroed.
+extern void *NativeMidi_ArenaAlloc(MIDIArena *arena, size_t len);
+
+// Release an arena and everything allocated from it.
+extern void NativeMidi_DestroyArena(MIDIArena *arena);
+
+// A single midi event. Events are stored by value in one flat array (see
+//  MIDIEventList) so walking a song is a linear scan; extra data is kept
+//  out of line in the list's payload buffer.
 typedef struct MIDIEvent
 {
     Uint32  time;       // Time at which this midi events occurs
@@ -44,17 +70,178 @@ typedef struct MIDIEvent
     Uint8   data[2];    // 1 or 2 bytes additional data for most events
 
     Uint32  extraLen;   // For some SysEx events, we need additional storage
-    Uint8   *extraData;
-
-    struct MIDIEvent *next;
+    Uint32  extraOffset; // Offset of the extra data in MIDIEventList.payload
 } MIDIEvent;
 
+// A tempo change: from time on, a quarter note lasts tempo microseconds.
+typedef struct MIDITempo
+{
+    Uint32  time;
+    Uint32  tempo;
+} MIDITempo;
+
+// A time signature: from time on, a bar has numerator beats, each lasting a
+//  1/2^denominator note.
+typedef struct MIDITimeSig
+{
+    Uint32  time;
+    Uint8   numerator;
+    Uint8   denominator;    // as a power of 2, as in the file
+    Uint8   clocks;         // MIDI clocks per metronome click
+    Uint8   notated32nds;   // notated 32nd notes per quarter note
+} MIDITimeSig;
+
+// Where the time of a song goes. Next to its tempo changes and time
+//  signatures, the map keeps the microsecond and bar each of them starts
+//  at, so positions convert with a binary search.
+typedef struct MIDITimeMap
+{
+    Uint16  division;       // Ticks per quarter note, or SMPTE frame rate and resolution
+    Uint32  endTime;        // Time of the last event
+
+    const MIDITempo *tempo; // nTempo tempo changes, sorted by time
+    const Uint64 *tempoStart; // Microsecond each of them starts at
+    Uint32  nTempo;
+
+    const MIDITimeSig *timeSig; // nTimeSig time signatures, sorted by time
+    const Uint32 *timeSigBar; // Bar each of them starts at
+    Uint32  nTimeSig;
+} MIDITimeMap;
+
+// Copy a time map into a single allocation, to be freed with NativeMidi_free.
+extern MIDITimeMap *NativeMidi_CopyTimeMap(const MIDITimeMap *map);
+
+// Get the time map of a song; each backend has its own. This function
+//  returns NULL if there is none, with the error set.
+extern const MIDITimeMap *NativeMidi_GetSongTimeMap(NativeMidi_Song *song);
+
+// Convert between ticks and microseconds following the tempo changes of a map.
+extern Uint64 NativeMidi_MapTicksToMicroseconds(const MIDITimeMap *map, Uint32 ticks);
+extern Uint32 NativeMidi_MapMicrosecondsToTicks(const MIDITimeMap *map, Uint64 us);
+
+#define MIDI_NUM_CHANNELS   16
+#define MIDI_CHASE_UNSET    0xFF
+
+// What the channels of a song are set to at some point, which is what a
+//  player has to send to start playing from there. Whatever the song hasn't
+//  set by then is MIDI_CHASE_UNSET; channel mode messages (controllers 120
+//  and up) aren't state and aren't kept.
+typedef struct MIDIChannelState
+{
+    Uint8   controller[120];
+    Uint8   program;
+    Uint8   bend[2];        // LSB, MSB
+} MIDIChannelState;
+
+typedef struct MIDIChaseState
+{
+    Uint32  tempo;          // 0 until the song sets one
+    MIDIChannelState channel[MIDI_NUM_CHANNELS];
+} MIDIChaseState;
+
+// Start a chase state out with nothing set.
+extern void NativeMidi_ResetChaseState(MIDIChaseState *state);
+
+// Apply an event, with its extra data, to a chase state.
+extern void NativeMidi_ChaseEvent(MIDIChaseState *state, const MIDIEvent *event, const Uint8 *extra);
+
+// The read-only data of a whole file, either mapped or read into memory,
+//  shared by whoever needs the bytes to stay around.
+typedef struct MIDIMapping MIDIMapping;
+
+// A complete song: every track merged into one time-ordered array.
+//  The list, its events and its payload live in the list's arena; identical
+//  payloads (think of repeated GM/GS resets) are stored once. When a song is
+//  loaded from a mapped file or from memory that outlives it, the payload is
+//  not copied at all but points straight into the file data. The same goes
+//  for the events and time map of precompiled songs on little-endian hosts,
+//  which is why none of them may be modified. Lists are reference counted,
+//  as the song cache shares them among all songs loaded from the same data.
+typedef struct MIDIEventList
+{
+    MIDIArena *arena;   // Owns the list and nothing else
+    MIDIMapping *mapping; // Keeps the file data alive while payload points into it
+    SDL_AtomicInt refcount;
+
+    const MIDIEvent *events; // nEvents events, sorted by time
+    Uint32  nEvents;
+    Uint32  nThinned;   // Events dropped as redundant when the song was decoded
+
+    const Uint8 *payload; // SysEx/meta data of all events
+    Uint32  payloadLen;
+
+    MIDITimeMap time;   // Length, tempo changes and time signatures
+    Uint32  maxSysexLen; // Length of the longest SysEx message
+
+    const MIDIChaseState *checkpoints; // Chase state every so many events, for seeking
+    Uint32  nCheckpoints;
+} MIDIEventList;
+
+// Get a pointer to the extra data of an event in a list.
+static SDL_INLINE const Uint8 *NativeMidi_GetExtraData(const MIDIEventList *list, const MIDIEvent *event)
+{
+    return list->payload + event->extraOffset;
+}
+
+// Load a midifile or a precompiled song to memory, converting it to a list
+//  of MIDIEvents. Memory streams are decoded in place instead of being read
+//  into a copy. If the song cache is enabled, a list decoded from the same
+//  data before may be handed out again.
+//  This function returns a MIDIEventList, NULL if an error occured.
+extern MIDIEventList *NativeMidi_CreateMIDIEventList(SDL_IOStream *src, Uint16 *division);
+
+// Find the first event of a list at or after time, and the chase state
+//  right before it. This replays no more than the events since the last
+//  checkpoint. This function returns the index of the event.
+extern Uint32 NativeMidi_SeekMIDIEventList(const MIDIEventList *list, Uint32 time, MIDIChaseState *state);
+
+// Release a MIDIEventList after usage. It goes away with the last reference.
+extern void NativeMidi_FreeMIDIEventList(MIDIEventList *list);
+
+// A song that is decoded while it's played: every track has its own cursor,
+//  and the tracks are merged one event at a time. Nothing but the file data
+//  is kept (and that is left where it is if it's a mapped file), so starting
+//  takes the same time and the memory used stays the same no matter how many
+//  events the song has.
+typedef struct MIDIEventStream MIDIEventStream;
+
+// Open a midifile for streaming. Precompiled songs are already decoded and
+//  are played from their event list. This function returns NULL if an error
+//  occured, or if the song has no events at all.
+extern MIDIEventStream *NativeMidi_CreateMIDIEventStream(SDL_IOStream *src, Uint16 *division);
+
+// Pack the events of a list into a compact stream, which takes a fraction of
+//  the memory and is decoded while it's played. The stream doesn't depend on
+//  the list, which can be released right away. This function returns NULL if
+//  an error occured.
+extern MIDIEventStream *NativeMidi_CompactMIDIEventList(const MIDIEventList *list);
+
+// Get the next event of a stream, and its extra data if extra isn't NULL,
+//  without consuming it. Both stay valid until the stream is advanced.
+//  This function returns NULL at the end of the song.
+extern const MIDIEvent *NativeMidi_PeekMIDIEventStream(const MIDIEventStream *stream, const Uint8 **extra);
+
+// Move on to the next event of a stream.
+extern void NativeMidi_AdvanceMIDIEventStream(MIDIEventStream *stream);
+
+// Go back to the first event of a stream.
+extern void NativeMidi_RewindMIDIEventStream(MIDIEventStream *stream);
+
+// Move a stream to its first event at or after time, and get the chase state
+//  right before it. A midifile has no checkpoints, so it's replayed from the
+//  start; compact streams go on from the last checkpoint before time.
+extern void NativeMidi_SeekMIDIEventStream(MIDIEventStream *stream, Uint32 time, MIDIChaseState *state);
+
+// Get the time map of a stream. A midifile has to be scanned for it, which
+//  happens the first time it's asked for, and leaves the stream's position
+//  alone. This function returns NULL if an error occured.
+extern const MIDITimeMap *NativeMidi_GetMIDIEventStreamTimeMap(MIDIEventStream *stream);
 
-// Load a midifile to memory, converting it to a list of MIDIEvents.
-//  This function returns a linked lists of MIDIEvents, 0 if an error occured.
-extern MIDIEvent *NativeMidi_CreateMIDIEventList(SDL_IOStream *src, Uint16 *division);
+// Release a MIDIEventStream after usage.
+extern void NativeMidi_FreeMIDIEventStream(MIDIEventStream *stream);
 
-// Release a MIDIEvent list after usage.
-extern void NativeMidi_FreeMIDIEventList(MIDIEvent *head);
+// Add what a list or stream costs to a song's stats.
+extern void NativeMidi_AddMIDIEventListStats(const MIDIEventList *list, NativeMidi_SongStats *stats);
+extern void NativeMidi_AddMIDIEventStreamStats(const MIDIEventStream *stream, NativeMidi_SongStats *stats);
 
 #endif // _NATIVE_MIDI_COMMON_H_
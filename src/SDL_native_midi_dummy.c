@@ -46,10 +46,26 @@ void NativeMidi_DestroySong(NativeMidi_Song *song)
 {
 }
 
+bool NativeMidi_GetSongStats(NativeMidi_Song *song, NativeMidi_SongStats *stats)
+{
+    return SDL_Unsupported();
+}
+
+const MIDITimeMap *NativeMidi_GetSongTimeMap(NativeMidi_Song *song)
+{
+    SDL_Unsupported();
+    return NULL;
+}
+
 void NativeMidi_Start(NativeMidi_Song *song, int loops)
 {
 }
 
+bool NativeMidi_Seek(NativeMidi_Song *song, Uint64 ms)
+{
+    return SDL_Unsupported();
+}
+
 void NativeMidi_Pause(void)
 {
 }
@@ -64,11 +80,28 @@ void NativeMidi_Stop(void)
 
 bool NativeMidi_Active(void)
 {
+    return false;
+}
+
+bool NativeMidi_GetPosition(Uint32 *ticks, Uint64 *ms)
+{
+    return SDL_Unsupported();
 }
 
 void NativeMidi_SetVolume(float volume)
 {
 }
 
+NativeMidi_Destination *NativeMidi_GetDestinations(int *count)
+{
+    SDL_Unsupported();
+    return NULL;
+}
+
+bool NativeMidi_SelectDestination(Uint32 id)
+{
+    return SDL_Unsupported();
+}
+
 #endif  /* platform check. */
 
@@ -29,12 +29,6 @@
 #include <MidiStore.h>
 #include <MidiDefs.h>
 #include <MidiSynthFile.h>
-#include <algorithm>
-
-static bool compareMIDIEvent(const MIDIEvent &a, const MIDIEvent &b)
-{
-    return a.time < b.time;
-}
 
 class MidiEventsStore : public BMidi
 {
@@ -51,13 +45,9 @@ public:
         if (!fEvs) {
             return B_BAD_MIDI_DATA;
         }
-        fTotal = 0;
-        for (MIDIEvent *x = fEvs; x; x = x->next) {
-            fTotal++;
-        }
+        // The list is already sorted by time
+        fTotal = (int)fEvs->nEvents;
         fPos = fTotal;
-
-        sort_events();
         return B_OK;
     }
 
@@ -65,23 +55,21 @@ public:
     {
         fPlaying = true;
         fPos = 0;
-        MIDIEvent *ev = fEvs;
 
         const uint32 startTime = B_NOW;
         while (KeepRunning()) {
-            if (!ev) {
+            if (fPos == fTotal) {
                 if (fLoops && fEvs) {
                     if (fLoops > 0) {
                         --fLoops;
                     }
                     fPos = 0;
-                    ev = fEvs;
                 } else {
                     break;
                 }
             }
+            const MIDIEvent *ev = &fEvs->events[fPos];
             SprayEvent(ev, ev->time + startTime);
-            ev = ev->next;
             fPos++;
         }
         fPos = fTotal;
@@ -106,15 +94,20 @@ public:
         fLoops = loops;
     }
 
+    const MIDIEventList *Events() const
+    {
+        return fEvs;
+    }
+
 protected:
-    MIDIEvent *fEvs;
+    MIDIEventList *fEvs;
     Uint16 fDivision;
 
     int fPos, fTotal;
     int fLoops;
     bool fPlaying;
 
-    void SprayEvent(MIDIEvent *ev, uint32 time)
+    void SprayEvent(const MIDIEvent *ev, uint32 time)
     {
         switch (ev->status & 0xF0) {
             case B_NOTE_OFF:
@@ -142,7 +135,7 @@ protected:
             case 0xF:
                 switch (ev->status) {
                     case B_SYS_EX_START:
-                        SpraySystemExclusive(ev->extraData, ev->extraLen, time);
+                        SpraySystemExclusive((void *)NativeMidi_GetExtraData(fEvs, ev), ev->extraLen, time);
                         break;
                     case B_MIDI_TIME_CODE:
                     case B_SONG_POSITION:
@@ -162,7 +155,8 @@ protected:
                     case B_SYSTEM_RESET:
                         if (ev->data[0] == 0x51 && ev->data[1] == 0x03) {
                             SDL_assert(ev->extraLen == 3);
-                            const int val = (ev->extraData[0] << 16) | (ev->extraData[1] << 8) | ev->extraData[2];
+                            const Uint8 *extra = NativeMidi_GetExtraData(fEvs, ev);
+                            const int val = (extra[0] << 16) | (extra[1] << 8) | extra[2];
                             const int tempo = 60000000 / val;
                             SprayTempoChange(tempo, time);
                         } else {
@@ -173,31 +167,6 @@ protected:
                 break;
         }
     }
-
-    void sort_events()
-    {
-        MIDIEvent *items = new MIDIEvent[fTotal];
-        MIDIEvent *x = fEvs;
-        for (int i = 0; i < fTotal; i++) {
-            SDL_copyp(items + i, x);
-            x = x->next;
-        }
-        std::sort(items, items + fTotal, compareMIDIEvent);
-
-        x = fEvs;
-
-        for (int i = 0; i < fTotal; i++) {
-            MIDIEvent *ne = x->next;
-            SDL_copyp(x, items + i);
-            x->next = ne;
-            x = ne;
-        }
-
-        for (x = fEvs; x && x->next; x = x->next) {
-            SDL_assert(x->time <= x->next->time);
-        }
-        delete[] items;
-    }
 };
 
 static BMidiSynth synth;
@@ -216,6 +185,7 @@ bool NativeMidi_Init(void)
 
 void NativeMidi_Quit(void)
 {
+    NativeMidi_ClearCache();
 }
 
 void NativeMidi_SetVolume(float volume)
@@ -256,6 +226,26 @@ void NativeMidi_DestroySong(NativeMidi_Song *song)
     }
 }
 
+bool NativeMidi_GetSongStats(NativeMidi_Song *song, NativeMidi_SongStats *stats)
+{
+    if (!song) {
+        return SDL_InvalidParamError("song");
+    } else if (!stats) {
+        return SDL_InvalidParamError("stats");
+    }
+
+    SDL_zerop(stats);
+    stats->allocations = 2;
+    stats->resident_bytes = sizeof(NativeMidi_Song) + sizeof(MidiEventsStore);
+    NativeMidi_AddMIDIEventListStats(song->store->Events(), stats);
+    return true;
+}
+
+const MIDITimeMap *NativeMidi_GetSongTimeMap(NativeMidi_Song *song)
+{
+    return &song->store->Events()->time;
+}
+
 void NativeMidi_Start(NativeMidi_Song *song, int loops)
 {
     NativeMidi_Stop();
@@ -265,6 +255,11 @@ void NativeMidi_Start(NativeMidi_Song *song, int loops)
     currentSong = song;
 }
 
+bool NativeMidi_Seek(NativeMidi_Song *song, Uint64 ms)
+{
+    return SDL_Unsupported();
+}
+
 void NativeMidi_Pause(void)
 {
     // !!! FIXME: NativeMidi_Pause is currently unimplemented on Haiku
@@ -292,4 +287,20 @@ bool NativeMidi_Active(void)
     return currentSong ? currentSong->store->IsPlaying() : false;
 }
 
+bool NativeMidi_GetPosition(Uint32 *ticks, Uint64 *ms)
+{
+    return SDL_Unsupported();
+}
+
+NativeMidi_Destination *NativeMidi_GetDestinations(int *count)
+{
+    SDL_Unsupported();
+    return NULL;
+}
+
+bool NativeMidi_SelectDestination(Uint32 id)
+{
+    return SDL_Unsupported();
+}
+
 #endif  // SDL_PLATFORM_HAIKU
@@ -34,6 +34,8 @@ struct NativeMidi_Song
     MusicPlayer player;
     MusicSequence sequence;
     MusicTimeStamp endTime;
+    MusicTimeStamp startTime;
+    MIDITimeMap *timeMap;
     AudioUnit audiounit;
     int loops;
 };
@@ -116,6 +118,27 @@ static OSStatus GetSequenceAudioUnitMatching(MusicSequence sequence, AudioUnit *
     return kAUGraphErr_NodeNotFound;
 }
 
+// The OS keeps a tempo track of its own, but knows nothing about ticks or
+//  time signatures, so the time map is scanned from the file all the same.
+static MIDITimeMap *ScanSongTimeMap(const void *buf, size_t len)
+{
+    MIDITimeMap *map = NULL;
+    SDL_IOStream *io = SDL_IOFromConstMem(buf, len);
+
+    if (io) {
+        MIDIEventStream *stream = NativeMidi_CreateMIDIEventStream(io, NULL);
+        if (stream) {
+            const MIDITimeMap *scanned = NativeMidi_GetMIDIEventStreamTimeMap(stream);
+            if (scanned) {
+                map = NativeMidi_CopyTimeMap(scanned);
+            }
+            NativeMidi_FreeMIDIEventStream(stream);
+        }
+        SDL_CloseIO(io);
+    }
+    return map;
+}
+
 #if 0  // !!! FIXME: needs the soundfont APIs from SDL2_Mixer. Is this necessary...?
 typedef struct
 {
@@ -201,7 +224,7 @@ NativeMidi_Song *NativeMidi_LoadSong_IO(SDL_IOStream *src, bool closeio)
         goto fail;
     }
 
-    retval = SDL_calloc(1, sizeof(NativeMidi_Song));
+    retval = NativeMidi_calloc(1, sizeof(NativeMidi_Song));
     if (retval == NULL) {
         goto fail;
     } else if (NewMusicPlayer(&retval->player) != noErr) {
@@ -215,6 +238,9 @@ NativeMidi_Song *NativeMidi_LoadSong_IO(SDL_IOStream *src, bool closeio)
         goto fail;
     }
 
+    // Songs the OS plays but we can't read simply have no time map
+    retval->timeMap = ScanSongTimeMap(buf, len);
+
     SDL_free(buf);
     buf = NULL;
 
@@ -243,7 +269,8 @@ fail:
         if (retval->player) {
             DisposeMusicPlayer(retval->player);
         }
-        SDL_free(retval);
+        NativeMidi_free(retval->timeMap);
+        NativeMidi_free(retval);
     }
 
     if (data) {
@@ -270,10 +297,24 @@ void NativeMidi_DestroySong(NativeMidi_Song *song)
 
         DisposeMusicSequence(song->sequence);
         DisposeMusicPlayer(song->player);
-        SDL_free(song);
+        NativeMidi_free(song->timeMap);
+        NativeMidi_free(song);
     }
 }
 
+bool NativeMidi_GetSongStats(NativeMidi_Song *song, NativeMidi_SongStats *stats)
+{
+    return SDL_Unsupported();
+}
+
+const MIDITimeMap *NativeMidi_GetSongTimeMap(NativeMidi_Song *song)
+{
+    if (!song->timeMap) {
+        SDL_SetError("Song has no time map");
+    }
+    return song->timeMap;
+}
+
 static NativeMidi_Song* paused_song = NULL;
 static MusicTimeStamp paused_time = 0;
 static bool resume = false;
@@ -304,9 +345,30 @@ void NativeMidi_Start(NativeMidi_Song *song, int loops)
         latched_volume += 1.0f;  // +1 just make this not match.
         NativeMidi_SetVolume(vol);
 
-        MusicPlayerSetTime(song->player, resume ? paused_time : 0);
+        MusicPlayerSetTime(song->player, resume ? paused_time : song->startTime);
         MusicPlayerStart(song->player);
+        song->startTime = 0;
+    }
+}
+
+bool NativeMidi_Seek(NativeMidi_Song *song, Uint64 ms)
+{
+    MusicTimeStamp beats = 0;
+
+    if (!song) {
+        return SDL_InvalidParamError("song");
+    } else if (MusicSequenceGetBeatsForSeconds(song->sequence, (Float64)ms / 1000.0, &beats) != noErr) {
+        return SDL_SetError("MusicSequenceGetBeatsForSeconds failed");
     }
+
+    if (song == currentsong) {
+        MusicPlayerSetTime(song->player, beats);
+    } else if (song == paused_song) {
+        paused_time = beats;
+    } else {
+        song->startTime = beats;
+    }
+    return true;
 }
 
 void NativeMidi_Pause(void)
@@ -366,6 +428,41 @@ bool NativeMidi_Active(void)
     return false;
 }
 
+bool NativeMidi_GetPosition(Uint32 *ticks, Uint64 *ms)
+{
+    MusicTimeStamp currentTime = 0;
+    Float64 seconds = 0;
+    NativeMidi_Song *song = currentsong ? currentsong : paused_song;
+    const MIDITimeMap *map;
+    Uint64 us;
+
+    if (song == NULL) {
+        return SDL_SetError("No song is playing");
+    } else if (!(map = NativeMidi_GetSongTimeMap(song))) {
+        return false;
+    }
+
+    if (paused_song) {
+        currentTime = paused_time;
+    } else {
+        MusicPlayerGetTime(song->player, &currentTime);
+    }
+    currentTime = SDL_min(currentTime, song->endTime);
+
+    if (MusicSequenceGetSecondsForBeats(song->sequence, currentTime, &seconds) != noErr) {
+        return SDL_SetError("MusicSequenceGetSecondsForBeats failed");
+    }
+
+    us = (Uint64)(SDL_max(seconds, 0.0) * 1000000.0);
+    if (ticks) {
+        *ticks = NativeMidi_MapMicrosecondsToTicks(map, us);
+    }
+    if (ms) {
+        *ms = us / 1000;
+    }
+    return true;
+}
+
 void NativeMidi_SetVolume(float volume)
 {
     if (latched_volume != volume) {
@@ -376,5 +473,16 @@ void NativeMidi_SetVolume(float volume)
     }
 }
 
+NativeMidi_Destination *NativeMidi_GetDestinations(int *count)
+{
+    SDL_Unsupported();
+    return NULL;
+}
+
+bool NativeMidi_SelectDestination(Uint32 id)
+{
+    return SDL_Unsupported();
+}
+
 #endif
 
@@ -37,6 +37,7 @@ struct NativeMidi_Song
     int CurrentHdr;
     MIDIHDR MidiStreamHdr[2];
     MIDIEVENT *NewEvents;
+    MIDITimeMap *TimeMap;
     Uint16 ppqn;
     int Size;
     int NewPos;
@@ -90,27 +91,21 @@ static bool BlockOut(NativeMidi_Song *song)
     return true;
 }
 
-static void MIDItoStream(NativeMidi_Song *song, MIDIEvent *evntlist)
+static void MIDItoStream(NativeMidi_Song *song, MIDIEventList *evntlist)
 {
-    MIDIEvent *event = evntlist;
     MIDIEVENT *newevent;
     int eventcount = 0;
     int time = 0;
+    Uint32 i;
 
-    while (event) {
-        eventcount++;
-        event = event->next;
-    }
-
-    song->NewEvents = SDL_calloc(eventcount, 3 * sizeof(DWORD));
+    song->NewEvents = NativeMidi_calloc(evntlist->nEvents, 3 * sizeof(DWORD));
     if (!song->NewEvents) {
         return;
     }
 
-    eventcount = 0;
-    event = evntlist;
     newevent = song->NewEvents;
-    while (event) {
+    for (i = 0; i < evntlist->nEvents; i++) {
+        const MIDIEvent *event = &evntlist->events[i];
         const int status = (event->status & 0xF0) >> 4;
         switch (status) {
             case MIDI_STATUS_NOTE_OFF:
@@ -128,7 +123,8 @@ static void MIDItoStream(NativeMidi_Song *song, MIDIEvent *evntlist)
 
             case MIDI_STATUS_SYSEX:
                 if ((event->status == 0xFF) && (event->data[0] == 0x51)) {  // Tempo change
-                    const int tempo = (event->extraData[0] << 16) | (event->extraData[1] << 8) | event->extraData[2];
+                    const Uint8 *extra = NativeMidi_GetExtraData(evntlist, event);
+                    const int tempo = (extra[0] << 16) | (extra[1] << 8) | extra[2];
                     newevent->dwDeltaTime = event->time;
                     newevent->dwEvent = (MEVT_TEMPO<<24) | tempo;
                     newevent=(MIDIEVENT*)((char*)newevent + (3 * sizeof(DWORD)));
@@ -136,8 +132,6 @@ static void MIDItoStream(NativeMidi_Song *song, MIDIEvent *evntlist)
                 }
                 break;
         }
-
-        event = event->next;
     }
 
     song->Size = eventcount * 3 * sizeof(DWORD);
@@ -217,11 +211,12 @@ bool NativeMidi_Init(void)
 
 void NativeMidi_Quit(void)
 {
+    NativeMidi_ClearCache();
 }
 
 NativeMidi_Song *NativeMidi_LoadSong_IO(SDL_IOStream *src, bool closeio)
 {
-    NativeMidi_Song *newsong = (NativeMidi_Song *) SDL_malloc(sizeof(NativeMidi_Song));
+    NativeMidi_Song *newsong = (NativeMidi_Song *) NativeMidi_malloc(sizeof(NativeMidi_Song));
     if (!newsong) {
         return NULL;
     }
@@ -229,21 +224,27 @@ NativeMidi_Song *NativeMidi_LoadSong_IO(SDL_IOStream *src, bool closeio)
 
     newsong->mutex = SDL_CreateMutex();
     if (!newsong->mutex) {
-        SDL_free(newsong);
+        NativeMidi_free(newsong);
         return NULL;
     }
 
     // Attempt to load the midi file
-    MIDIEvent *evntlist = NativeMidi_CreateMIDIEventList(src, &newsong->ppqn);
+    MIDIEventList *evntlist = NativeMidi_CreateMIDIEventList(src, &newsong->ppqn);
     if (!evntlist) {
         SDL_DestroyMutex(newsong->mutex);
-        SDL_free(newsong);
+        NativeMidi_free(newsong);
         return NULL;
     }
 
     MIDItoStream(newsong, evntlist);
 
+    // The list doesn't outlive loading, its time map has to
+    newsong->TimeMap = NativeMidi_CopyTimeMap(&evntlist->time);
     NativeMidi_FreeMIDIEventList(evntlist);
+    if (!newsong->TimeMap) {
+        NativeMidi_DestroySong(newsong);
+        return NULL;
+    }
 
     if (closeio) {
         SDL_CloseIO(src);
@@ -254,10 +255,38 @@ NativeMidi_Song *NativeMidi_LoadSong_IO(SDL_IOStream *src, bool closeio)
 void NativeMidi_DestroySong(NativeMidi_Song *song)
 {
     if (song) {
-        SDL_free(song->NewEvents);
+        NativeMidi_free(song->NewEvents);
+        NativeMidi_free(song->TimeMap);
         SDL_DestroyMutex(song->mutex);
-        SDL_free(song);
+        NativeMidi_free(song);
+    }
+}
+
+bool NativeMidi_GetSongStats(NativeMidi_Song *song, NativeMidi_SongStats *stats)
+{
+    if (!song) {
+        return SDL_InvalidParamError("song");
+    } else if (!stats) {
+        return SDL_InvalidParamError("stats");
     }
+
+    // The event list is gone once it's converted to stream buffers
+    SDL_zerop(stats);
+    stats->events = (Uint32)(song->Size / (3 * sizeof(DWORD)));
+    stats->allocations = 1;
+    stats->resident_bytes = sizeof(NativeMidi_Song);
+    if (song->NewEvents) {
+        stats->allocations++;
+        stats->resident_bytes += NativeMidi_GetAllocSize(song->NewEvents);
+    }
+    stats->allocations++;
+    stats->resident_bytes += NativeMidi_GetAllocSize(song->TimeMap);
+    return true;
+}
+
+const MIDITimeMap *NativeMidi_GetSongTimeMap(NativeMidi_Song *song)
+{
+    return song->TimeMap;
 }
 
 void NativeMidi_Start(NativeMidi_Song *song, int loops)
@@ -284,6 +313,11 @@ void NativeMidi_Start(NativeMidi_Song *song, int loops)
     }
 }
 
+bool NativeMidi_Seek(NativeMidi_Song *song, Uint64 ms)
+{
+    return SDL_Unsupported();
+}
+
 void NativeMidi_Pause(void)
 {
     if (hMidiStream) {
@@ -317,6 +351,11 @@ bool NativeMidi_Active(void)
     return hMidiStream && currentsong && currentsong->MusicPlaying;
 }
 
+bool NativeMidi_GetPosition(Uint32 *ticks, Uint64 *ms)
+{
+    return SDL_Unsupported();
+}
+
 void NativeMidi_SetVolume(float volume)
 {
     const int ivolume = (int) (SDL_clamp(volume, 0.0f, 1.0f) * 128.0f);
@@ -324,4 +363,15 @@ void NativeMidi_SetVolume(float volume)
     midiOutSetVolume((HMIDIOUT)hMidiStream, MAKELONG(calcVolume , calcVolume));
 }
 
+NativeMidi_Destination *NativeMidi_GetDestinations(int *count)
+{
+    SDL_Unsupported();
+    return NULL;
+}
+
+bool NativeMidi_SelectDestination(Uint32 id)
+{
+    return SDL_Unsupported();
+}
+
 #endif // Windows native MIDI support
@@ -0,0 +1,531 @@
+/*
+  SDL_native_midi: Platform-specific MIDI support.
+  Copyright (C) 2000-2025 Sam Lantinga <slouken@libsdl.org>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.  In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions:
+
+  1. The origin of this software must not be misrepresented; you must not
+     claim that you wrote the original software. If you use this software
+     in a product, an acknowledgment in the product documentation would be
+     appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+     misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+/*
+ * Measures what NativeMidi_CreateMIDIEventList and NativeMidi_FreeMIDIEventList
+ * cost on synthetic songs of various stress shapes: time, throughput, number
+ * of allocations and peak heap use. Every song is generated the same way on
+ * every run. Nothing is played, so this runs anywhere.
+ *
+ * USAGE: bench_sdl_native_midi [--csv] [--iterations N] [case ...]
+ *
+ * With --csv, results are written to stdout as CSV, one line per case, for
+ * tracking regressions. Otherwise they are logged as a table.
+ */
+
+#include "SDL_native_midi_common.h"
+
+#include <stdio.h>
+
+#define BENCH_DEFAULT_ITERATIONS 5
+
+typedef struct
+{
+    Uint8 *data;
+    size_t len;
+    size_t allocated;
+} MidiBuffer;
+
+static bool Put(MidiBuffer *buf, const void *data, size_t len)
+{
+    if (buf->len + len > buf->allocated) {
+        size_t allocated = buf->allocated ? buf->allocated * 2 : 4096;
+        while (allocated < buf->len + len) {
+            allocated *= 2;
+        }
+        Uint8 *ptr = (Uint8 *) SDL_realloc(buf->data, allocated);
+        if (!ptr) {
+            return false;
+        }
+        buf->data = ptr;
+        buf->allocated = allocated;
+    }
+    SDL_memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return true;
+}
+
+static bool PutByte(MidiBuffer *buf, Uint8 value)
+{
+    return Put(buf, &value, 1);
+}
+
+static bool PutU32BE(MidiBuffer *buf, Uint32 value)
+{
+    const Uint8 bytes[4] = { (Uint8)(value >> 24), (Uint8)(value >> 16), (Uint8)(value >> 8), (Uint8)value };
+    return Put(buf, bytes, sizeof(bytes));
+}
+
+static bool PutU16BE(MidiBuffer *buf, Uint16 value)
+{
+    const Uint8 bytes[2] = { (Uint8)(value >> 8), (Uint8)value };
+    return Put(buf, bytes, sizeof(bytes));
+}
+
+static bool PutVLQ(MidiBuffer *buf, Uint32 value)
+{
+    Uint8 bytes[4];
+    int i = sizeof(bytes);
+
+    bytes[--i] = value & 0x7F;
+    while ((value >>= 7) != 0) {
+        bytes[--i] = (value & 0x7F) | 0x80;
+    }
+    return Put(buf, bytes + i, sizeof(bytes) - i);
+}
+
+/* xorshift32, so every run generates the same songs. */
+static Uint32 NextRandom(Uint32 *state)
+{
+    Uint32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static bool BeginSong(MidiBuffer *buf, int ntracks)
+{
+    buf->len = 0;
+    return Put(buf, "MThd", 4) && PutU32BE(buf, 6) && PutU16BE(buf, 1) &&
+           PutU16BE(buf, (Uint16)ntracks) && PutU16BE(buf, 480);
+}
+
+/* Start a track; returns where its length goes, or 0 if out of memory. */
+static size_t BeginTrack(MidiBuffer *buf)
+{
+    if (!Put(buf, "MTrk", 4) || !PutU32BE(buf, 0)) {
+        return 0;
+    }
+    return buf->len - 4;
+}
+
+static bool EndTrack(MidiBuffer *buf, size_t lenpos)
+{
+    static const Uint8 end_of_track[] = { 0x00, 0xFF, 0x2F, 0x00 };
+    Uint32 tracklen;
+
+    if (!Put(buf, end_of_track, sizeof(end_of_track))) {
+        return false;
+    }
+    tracklen = (Uint32)(buf->len - (lenpos + 4));
+    buf->data[lenpos + 0] = (Uint8)(tracklen >> 24);
+    buf->data[lenpos + 1] = (Uint8)(tracklen >> 16);
+    buf->data[lenpos + 2] = (Uint8)(tracklen >> 8);
+    buf->data[lenpos + 3] = (Uint8)tracklen;
+    return true;
+}
+
+/* Note on/off pairs spread evenly over every track. With running status, */
+/* notes are switched off with a velocity of 0 and no status byte is repeated. */
+static bool GenerateNotes(MidiBuffer *buf, int ntracks, int nevents, bool running)
+{
+    Uint32 seed = 0x2545F491;
+    int track;
+
+    if (!BeginSong(buf, ntracks)) {
+        return false;
+    }
+
+    for (track = 0; track < ntracks; track++) {
+        const int pairs = (nevents / ntracks) / 2;
+        const Uint8 on = (Uint8)(0x90 | (track & 0x0F));
+        const Uint8 off = running ? on : (Uint8)(0x80 | (track & 0x0F));
+        const size_t lenpos = BeginTrack(buf);
+        int i;
+
+        if (!lenpos) {
+            return false;
+        }
+        for (i = 0; i < pairs; i++) {
+            const Uint8 note = 36 + (Uint8)(NextRandom(&seed) % 48);
+            if (!PutVLQ(buf, (Uint32)(i % 7) * 10) ||
+                ((!running || i == 0) && !PutByte(buf, on)) || !PutByte(buf, note) || !PutByte(buf, 100) ||
+                !PutVLQ(buf, 60) ||
+                (!running && !PutByte(buf, off)) || !PutByte(buf, note) || !PutByte(buf, 0)) {
+                return false;
+            }
+        }
+        if (!EndTrack(buf, lenpos)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* A single track of large SysEx messages, each followed by a note. */
+static bool GenerateSysex(MidiBuffer *buf, int nsysex, int size)
+{
+    Uint32 seed = 0x68E31DA4;
+    const size_t lenpos = (BeginSong(buf, 1) ? BeginTrack(buf) : 0);
+    int i, j;
+
+    if (!lenpos) {
+        return false;
+    }
+    for (i = 0; i < nsysex; i++) {
+        if (!PutVLQ(buf, 10) || !PutByte(buf, 0xF0) || !PutVLQ(buf, (Uint32)size)) {
+            return false;
+        }
+        for (j = 0; j < size - 1; j++) {
+            if (!PutByte(buf, (Uint8)(NextRandom(&seed) & 0x7F))) {
+                return false;
+            }
+        }
+        if (!PutByte(buf, 0xF7) ||
+            !PutVLQ(buf, 0) || !PutByte(buf, 0x90) || !PutByte(buf, 60) || !PutByte(buf, 100) ||
+            !PutVLQ(buf, 10) || !PutByte(buf, 0x80) || !PutByte(buf, 60) || !PutByte(buf, 0)) {
+            return false;
+        }
+    }
+    return EndTrack(buf, lenpos);
+}
+
+/* One track per channel, bending on every tick. */
+static bool GeneratePitchBend(MidiBuffer *buf, int ntracks, int nevents)
+{
+    int track;
+
+    if (!BeginSong(buf, ntracks)) {
+        return false;
+    }
+
+    for (track = 0; track < ntracks; track++) {
+        const size_t lenpos = BeginTrack(buf);
+        int i;
+
+        if (!lenpos) {
+            return false;
+        }
+        for (i = 0; i < nevents / ntracks; i++) {
+            const int bend = (i * 37) & 0x3FFF;
+            if (!PutVLQ(buf, 1) || !PutByte(buf, (Uint8)(0xE0 | (track & 0x0F))) ||
+                !PutByte(buf, (Uint8)(bend & 0x7F)) || !PutByte(buf, (Uint8)(bend >> 7))) {
+                return false;
+            }
+        }
+        if (!EndTrack(buf, lenpos)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+typedef enum
+{
+    SHAPE_NOTES,
+    SHAPE_RUNNING_STATUS,
+    SHAPE_SYSEX,
+    SHAPE_PITCH_BEND
+} BenchShape;
+
+typedef struct
+{
+    const char *name;
+    BenchShape shape;
+    int a, b;   /* tracks and events, or SysEx count and size */
+} BenchCase;
+
+static const BenchCase bench_cases[] = {
+    { "tracks-1", SHAPE_NOTES, 1, 200000 },
+    { "tracks-16", SHAPE_NOTES, 16, 200000 },
+    { "tracks-256", SHAPE_NOTES, 256, 200000 },
+    { "tracks-2048", SHAPE_NOTES, 2048, 200000 },
+    { "notes-4m", SHAPE_NOTES, 16, 4000000 },
+    { "running-status", SHAPE_RUNNING_STATUS, 1, 1000000 },
+    { "sysex-large", SHAPE_SYSEX, 2000, 8192 },
+    { "pitch-bend", SHAPE_PITCH_BEND, 16, 1000000 },
+};
+
+static bool GenerateCase(MidiBuffer *buf, const BenchCase *c)
+{
+    switch (c->shape) {
+    case SHAPE_NOTES:
+        return GenerateNotes(buf, c->a, c->b, false);
+    case SHAPE_RUNNING_STATUS:
+        return GenerateNotes(buf, c->a, c->b, true);
+    case SHAPE_SYSEX:
+        return GenerateSysex(buf, c->a, c->b);
+    case SHAPE_PITCH_BEND:
+        return GeneratePitchBend(buf, c->a, c->b);
+    }
+    return false;
+}
+
+/* Every allocation is counted, and carries its size in front so the heap */
+/* in use can be tracked. Loading may use several threads, hence the lock. */
+#define ALLOC_HEADER 16
+
+static SDL_malloc_func real_malloc;
+static SDL_calloc_func real_calloc;
+static SDL_realloc_func real_realloc;
+static SDL_free_func real_free;
+
+static SDL_SpinLock alloc_lock;
+static Uint64 alloc_count;
+static Uint64 free_count;
+static size_t heap_in_use;
+static size_t heap_peak;
+
+static void *Track(Uint8 *ptr, size_t size)
+{
+    if (!ptr) {
+        return NULL;
+    }
+    *(size_t *)ptr = size;
+    SDL_LockSpinlock(&alloc_lock);
+    alloc_count++;
+    heap_in_use += size;
+    if (heap_in_use > heap_peak) {
+        heap_peak = heap_in_use;
+    }
+    SDL_UnlockSpinlock(&alloc_lock);
+    return ptr + ALLOC_HEADER;
+}
+
+static void Untrack(size_t size)
+{
+    SDL_LockSpinlock(&alloc_lock);
+    free_count++;
+    heap_in_use -= size;
+    SDL_UnlockSpinlock(&alloc_lock);
+}
+
+static void * SDLCALL CountingMalloc(size_t size)
+{
+    return Track((Uint8 *) real_malloc(ALLOC_HEADER + size), size);
+}
+
+static void * SDLCALL CountingCalloc(size_t nmemb, size_t size)
+{
+    if (size && nmemb > (SDL_SIZE_MAX - ALLOC_HEADER) / size) {
+        return NULL;
+    }
+    return Track((Uint8 *) real_calloc(1, ALLOC_HEADER + (nmemb * size)), nmemb * size);
+}
+
+static void * SDLCALL CountingRealloc(void *mem, size_t size)
+{
+    Uint8 *ptr;
+    size_t oldsize;
+
+    if (!mem) {
+        return CountingMalloc(size);
+    }
+    ptr = (Uint8 *)mem - ALLOC_HEADER;
+    oldsize = *(size_t *)ptr;
+    ptr = (Uint8 *) real_realloc(ptr, ALLOC_HEADER + size);
+    if (!ptr) {
+        return NULL;
+    }
+    /* A realloc counts as a free and a new allocation */
+    Untrack(oldsize);
+    return Track(ptr, size);
+}
+
+static void SDLCALL CountingFree(void *mem)
+{
+    if (mem) {
+        Uint8 *ptr = (Uint8 *)mem - ALLOC_HEADER;
+        Untrack(*(size_t *)ptr);
+        real_free(ptr);
+    }
+}
+
+typedef struct
+{
+    Uint64 allocs;
+    Uint64 frees;
+    size_t heap;
+    size_t peak;
+} AllocSnapshot;
+
+static void TakeSnapshot(AllocSnapshot *snapshot)
+{
+    SDL_LockSpinlock(&alloc_lock);
+    snapshot->allocs = alloc_count;
+    snapshot->frees = free_count;
+    snapshot->heap = heap_in_use;
+    snapshot->peak = heap_peak;
+    SDL_UnlockSpinlock(&alloc_lock);
+}
+
+static void ResetPeak(void)
+{
+    SDL_LockSpinlock(&alloc_lock);
+    heap_peak = heap_in_use;
+    SDL_UnlockSpinlock(&alloc_lock);
+}
+
+typedef struct
+{
+    Uint32 events;
+    size_t bytes;           /* size of the midi file */
+    double load_ms;         /* best of all iterations */
+    double free_ms;
+    Uint64 load_allocs;     /* allocations made while loading */
+    size_t load_peak;       /* heap in use at most while loading, on top of what was there */
+    size_t retained;        /* heap held by the loaded list */
+    Uint64 free_calls;      /* frees made while freeing the list */
+} BenchResult;
+
+static bool RunCase(const MidiBuffer *buf, int iterations, BenchResult *result)
+{
+    const double freq = (double)SDL_GetPerformanceFrequency();
+    Uint64 best_load = SDL_MAX_UINT64;
+    Uint64 best_free = SDL_MAX_UINT64;
+    int iter;
+
+    SDL_zerop(result);
+    result->bytes = buf->len;
+
+    for (iter = 0; iter < iterations; iter++) {
+        AllocSnapshot before, loaded, freed;
+        SDL_IOStream *io = SDL_IOFromConstMem(buf->data, buf->len);
+        Uint64 start, load_time, free_time;
+        MIDIEventList *list;
+
+        if (!io) {
+            SDL_Log("SDL_IOFromConstMem failed: %s", SDL_GetError());
+            return false;
+        }
+
+        ResetPeak();
+        TakeSnapshot(&before);
+        start = SDL_GetPerformanceCounter();
+        list = NativeMidi_CreateMIDIEventList(io, NULL);
+        load_time = SDL_GetPerformanceCounter() - start;
+        TakeSnapshot(&loaded);
+
+        if (!list) {
+            SDL_CloseIO(io);
+            return false;
+        }
+        result->events = list->nEvents;
+
+        start = SDL_GetPerformanceCounter();
+        NativeMidi_FreeMIDIEventList(list);
+        free_time = SDL_GetPerformanceCounter() - start;
+        TakeSnapshot(&freed);
+        SDL_CloseIO(io);
+
+        /* Allocations don't change from one iteration to the next */
+        if (iter == 0) {
+            result->load_allocs = loaded.allocs - before.allocs;
+            result->load_peak = loaded.peak - before.heap;
+            result->retained = loaded.heap - before.heap;
+            result->free_calls = freed.frees - loaded.frees;
+        }
+        best_load = SDL_min(best_load, load_time);
+        best_free = SDL_min(best_free, free_time);
+    }
+
+    result->load_ms = ((double)best_load * 1000.0) / freq;
+    result->free_ms = ((double)best_free * 1000.0) / freq;
+    return true;
+}
+
+static bool CaseSelected(const BenchCase *c, int argc, char **argv, int first)
+{
+    int i;
+
+    if (first == argc) {
+        return true;
+    }
+    for (i = first; i < argc; i++) {
+        if (SDL_strcmp(argv[i], c->name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    MidiBuffer buf = { NULL, 0, 0 };
+    int iterations = BENCH_DEFAULT_ITERATIONS;
+    bool csv = false;
+    int first = 1;
+    int i;
+
+    /* This has to happen before anything is allocated */
+    SDL_GetOriginalMemoryFunctions(&real_malloc, &real_calloc, &real_realloc, &real_free);
+    if (!SDL_SetMemoryFunctions(CountingMalloc, CountingCalloc, CountingRealloc, CountingFree)) {
+        SDL_Log("SDL_SetMemoryFunctions failed: %s", SDL_GetError());
+        return 1;
+    }
+
+    while (first < argc && argv[first][0] == '-') {
+        if (SDL_strcmp(argv[first], "--csv") == 0) {
+            csv = true;
+            first++;
+        } else if (SDL_strcmp(argv[first], "--iterations") == 0 && first + 1 < argc) {
+            iterations = SDL_max(SDL_atoi(argv[first + 1]), 1);
+            first += 2;
+        } else {
+            SDL_Log("USAGE: %s [--csv] [--iterations N] [case ...]", argv[0]);
+            return 1;
+        }
+    }
+
+    if (csv) {
+        printf("case,events,bytes,load_ms,events_per_s,mb_per_s,load_allocs,load_peak_bytes,retained_bytes,free_ms,free_calls\n");
+    } else {
+        SDL_Log("%-16s %9s %10s %10s %12s %8s %7s %11s %11s %8s %6s", "case", "events", "bytes", "load ms", "events/s", "MB/s",
+                "allocs", "peak heap", "retained", "free ms", "frees");
+    }
+
+    for (i = 0; i < (int)SDL_arraysize(bench_cases); i++) {
+        const BenchCase *c = &bench_cases[i];
+        BenchResult r;
+        double seconds;
+
+        if (!CaseSelected(c, argc, argv, first)) {
+            continue;
+        }
+        if (!GenerateCase(&buf, c)) {
+            SDL_Log("Out of memory");
+            return 1;
+        }
+        if (!RunCase(&buf, iterations, &r)) {
+            SDL_Log("Failed to load case '%s'", c->name);
+            return 1;
+        }
+
+        seconds = SDL_max(r.load_ms / 1000.0, 1e-9);
+        if (csv) {
+            printf("%s,%" SDL_PRIu32 ",%" SDL_PRIu64 ",%.3f,%.0f,%.1f,%" SDL_PRIu64 ",%" SDL_PRIu64 ",%" SDL_PRIu64 ",%.3f,%" SDL_PRIu64 "\n",
+                   c->name, r.events, (Uint64)r.bytes, r.load_ms, (double)r.events / seconds, ((double)r.bytes / (1024.0 * 1024.0)) / seconds,
+                   r.load_allocs, (Uint64)r.load_peak, (Uint64)r.retained, r.free_ms, r.free_calls);
+            fflush(stdout);
+        } else {
+            SDL_Log("%-16s %9" SDL_PRIu32 " %10" SDL_PRIu64 " %10.3f %12.0f %8.1f %7" SDL_PRIu64 " %11" SDL_PRIu64 " %11" SDL_PRIu64 " %8.3f %6" SDL_PRIu64,
+                    c->name, r.events, (Uint64)r.bytes, r.load_ms, (double)r.events / seconds, ((double)r.bytes / (1024.0 * 1024.0)) / seconds,
+                    r.load_allocs, (Uint64)r.load_peak, (Uint64)r.retained, r.free_ms, r.free_calls);
+        }
+    }
+
+    SDL_free(buf.data);
+    return 0;
+}
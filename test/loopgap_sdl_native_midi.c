@@ -0,0 +1,178 @@
+/*
+  SDL_native_midi: Platform-specific MIDI support.
+  Copyright (C) 2000-2025 Sam Lantinga <slouken@libsdl.org>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.  In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions:
+
+  1. The origin of this software must not be misrepresented; you must not
+     claim that you wrote the original software. If you use this software
+     in a product, an acknowledgment in the product documentation would be
+     appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+     misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+/*
+ * Measures how much later than it should a looping song starts over on ALSA.
+ * A song of evenly spaced notes is played into a sequencer port of our own,
+ * and the time between notes is compared within the song and across the
+ * point where it loops. This needs the ALSA sequencer, but no MIDI hardware.
+ * It fails if the loop point is notably later than any note within the song.
+ */
+
+#include <SDL3_native_midi/SDL_native_midi.h>
+
+#include <alsa/asoundlib.h>
+#include <poll.h>
+
+#define NOTES_PER_LOOP  16
+#define NOTE_TICKS      24      /* 1/16 notes at 96 ticks per quarter note */
+#define NOTE_NS         SDL_MS_TO_NS(125) /* ...and 120 beats per minute */
+#define LOOP_MARGIN_NS  SDL_MS_TO_NS(5) /* how much later than within the song the loop point may be */
+
+/* A format 0 song of NOTES_PER_LOOP notes, one every NOTE_TICKS. The last */
+/* note is held until the tick before the next one would start, which makes */
+/* that the end of the song: looping, the first note should follow on time. */
+static size_t GenerateSong(Uint8 *buf)
+{
+    static const Uint8 header[] = {
+        'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0, 96,
+        'M', 'T', 'r', 'k', 0, 0, 0, 0,
+        0x00, 0xFF, 0x51, 0x03, 0x07, 0xA1, 0x20 /* 500000 us per quarter note */
+    };
+    static const Uint8 end_of_track[] = { 0x00, 0xFF, 0x2F, 0x00 };
+    size_t len = sizeof(header);
+    Uint32 tracklen;
+    int i;
+
+    SDL_memcpy(buf, header, sizeof(header));
+    for (i = 0; i < NOTES_PER_LOOP; i++) {
+        const bool last = (i == NOTES_PER_LOOP - 1);
+        buf[len++] = (i == 0) ? 0 : NOTE_TICKS / 2;
+        buf[len++] = 0x90;
+        buf[len++] = (Uint8)(60 + i);
+        buf[len++] = 100;
+        buf[len++] = last ? NOTE_TICKS - 1 : NOTE_TICKS / 2;
+        buf[len++] = 0x80;
+        buf[len++] = (Uint8)(60 + i);
+        buf[len++] = 0;
+    }
+    SDL_memcpy(buf + len, end_of_track, sizeof(end_of_track));
+    len += sizeof(end_of_track);
+
+    tracklen = (Uint32)(len - 22);
+    buf[18] = (Uint8)(tracklen >> 24);
+    buf[19] = (Uint8)(tracklen >> 16);
+    buf[20] = (Uint8)(tracklen >> 8);
+    buf[21] = (Uint8)tracklen;
+    return len;
+}
+
+int main(int argc, char **argv)
+{
+    Uint8 songdata[64 + NOTES_PER_LOOP * 8];
+    const int loops = (argc > 1) ? SDL_max(SDL_atoi(argv[1]), 1) : 4;
+    const int expected = NOTES_PER_LOOP * (loops + 1);
+    snd_seq_t *seq;
+    struct pollfd pfd;
+    NativeMidi_Song *song;
+    Uint64 last = 0;
+    Sint64 inner_max = 0, inner_total = 0, loop_max = 0, loop_total = 0;
+    int inner_count = 0, loop_count = 0;
+    int received = 0;
+    int port;
+
+    if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK) < 0) {
+        SDL_Log("Couldn't open the ALSA sequencer");
+        return 1;
+    }
+    snd_seq_set_client_name(seq, "SDL_native_midi loop gap");
+    port = snd_seq_create_simple_port(seq, "Listener", SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+                                      SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    if (port < 0 || snd_seq_poll_descriptors(seq, &pfd, 1, POLLIN) != 1) {
+        SDL_Log("Couldn't create a sequencer port");
+        snd_seq_close(seq);
+        return 1;
+    }
+
+    if (!NativeMidi_Init()) {
+        SDL_Log("NativeMidi_Init failed: %s", SDL_GetError());
+        snd_seq_close(seq);
+        return 1;
+    }
+    if (!NativeMidi_SelectDestination(((Uint32)snd_seq_client_id(seq) << 8) | (Uint32)port)) {
+        SDL_Log("NativeMidi_SelectDestination failed: %s", SDL_GetError());
+        NativeMidi_Quit();
+        snd_seq_close(seq);
+        return 1;
+    }
+
+    song = NativeMidi_LoadSong_IO(SDL_IOFromConstMem(songdata, GenerateSong(songdata)), true);
+    if (!song) {
+        SDL_Log("Failed to load the song: %s", SDL_GetError());
+        NativeMidi_Quit();
+        snd_seq_close(seq);
+        return 1;
+    }
+
+    SDL_Log("Playing %d notes %d times, one every %d ms ...", NOTES_PER_LOOP, loops + 1, (int)(NOTE_NS / SDL_NS_PER_MS));
+    NativeMidi_Start(song, loops);
+
+    /* Time every note as it arrives; a second without any means the song is over */
+    while (received < expected && poll(&pfd, 1, 1000) > 0) {
+        snd_seq_event_t *ev;
+
+        while (snd_seq_event_input(seq, &ev) >= 0) {
+            const Uint64 now = SDL_GetTicksNS();
+            Sint64 late;
+
+            if (ev->type != SND_SEQ_EVENT_NOTEON || ev->data.note.velocity == 0) {
+                continue;
+            }
+            if (received > 0) {
+                late = (Sint64)(now - last) - (Sint64)NOTE_NS;
+                if (received % NOTES_PER_LOOP == 0) {
+                    SDL_Log("Loop %d: first note %.3f ms late", received / NOTES_PER_LOOP, late / 1000000.0);
+                    loop_max = SDL_max(loop_max, late);
+                    loop_total += late;
+                    loop_count++;
+                } else {
+                    inner_max = SDL_max(inner_max, late);
+                    inner_total += late;
+                    inner_count++;
+                }
+            }
+            last = now;
+            received++;
+        }
+    }
+
+    NativeMidi_Stop();
+    NativeMidi_DestroySong(song);
+    NativeMidi_Quit();
+    snd_seq_close(seq);
+
+    if (received < expected) {
+        SDL_Log("Only %d of %d notes arrived", received, expected);
+        return 1;
+    }
+    SDL_Log("Within the song: %.3f ms late on average, %.3f ms at most",
+            inner_total / 1000000.0 / SDL_max(inner_count, 1), inner_max / 1000000.0);
+    SDL_Log("Where it loops:  %.3f ms late on average, %.3f ms at most",
+            loop_total / 1000000.0 / SDL_max(loop_count, 1), loop_max / 1000000.0);
+
+    /* Starting over with a gap shows up as the loop point running late */
+    if (loop_max > inner_max + (Sint64)LOOP_MARGIN_NS) {
+        SDL_Log("The loop point is more than %d ms later than any note within the song",
+                (int)(LOOP_MARGIN_NS / SDL_NS_PER_MS));
+        return 1;
+    }
+    return 0;
+}
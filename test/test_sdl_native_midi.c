@@ -17,6 +17,7 @@ int main(int argc, char **argv)
     for (i = 1; i < argc; i++) {
         const char *path = argv[i];
         NativeMidi_Song *song;
+        Sint64 length;
 
         SDL_Log("Loading song '%s' ...", path);
         song = NativeMidi_LoadSong(path);
@@ -25,7 +26,13 @@ int main(int argc, char **argv)
             continue;
         }
 
-        SDL_Log("Starting song '%s' ...", path);
+        length = NativeMidi_GetSongLength(song);
+        if (length >= 0) {
+            const int seconds = (int)(length / 1000000);
+            SDL_Log("Starting song '%s' (%d:%02d) ...", path, seconds / 60, seconds % 60);
+        } else {
+            SDL_Log("Starting song '%s' ...", path);
+        }
         NativeMidi_Start(song, 0);
 
         while (NativeMidi_Active()) {
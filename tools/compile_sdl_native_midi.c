@@ -0,0 +1,24 @@
+#include <SDL3_native_midi/SDL_native_midi.h>
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    if (argc < 3 || (argc % 2) == 0) {
+        SDL_Log("USAGE: %s [in1.mid] [out1] [in2.mid] [out2] ...", argv[0]);
+        return 1;
+    }
+
+    for (i = 1; i < argc; i += 2) {
+        const char *srcpath = argv[i];
+        const char *dstpath = argv[i + 1];
+
+        if (!NativeMidi_CompileSong(srcpath, dstpath)) {
+            SDL_Log("Failed to compile '%s' to '%s': %s", srcpath, dstpath, SDL_GetError());
+            return 1;
+        }
+        SDL_Log("Compiled '%s' to '%s'", srcpath, dstpath);
+    }
+
+    return 0;
+}